@@ -6,11 +6,15 @@
 #include <Windows.h>
 #include <Shlwapi.h>
 #include <stdio.h>
-#include <math.h>
 #include "zilmar_controller_1.0.h"
 #include "sdl_input.h"
 #include "gui.h"
 #include "config.h"
+#include "sampler.h"
+#include "snapshot.h"
+#include "epoch.h"
+#include "stats.h"
+#include "log.h"
 
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved)
 {
@@ -18,10 +22,11 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved)
     {
     case DLL_PROCESS_ATTACH:
         InitializeCriticalSection(&critical_section);
+        stats_init();
 
         // make a log file
         CreateDirectoryA("Logs", NULL);
-        logfile = fopen("Logs\\" PLUGIN_NAME ".txt", "w");
+        log_open("Logs\\" PLUGIN_NAME ".txt");
 
         // get path to gamecontroller.txt
         GetModuleFileNameA(hinstDLL, dbpath, sizeof(dbpath));
@@ -30,11 +35,11 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved)
 
         // make/load a config file
         CreateDirectoryA("Config", NULL);
-        config_initialize(&concfg);
+        config_initialize();
 
         break;
     case DLL_PROCESS_DETACH:
-        fclose(logfile);
+        log_close();
         config_deinit();
 
         DeleteCriticalSection(&critical_section);
@@ -46,6 +51,10 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved)
 EXPORT void CALL CloseDLL(void)
 {
     dlog("CloseDLL() call");
+    sampler_close();
+    stats_dump();
+    config_save_devices();
+    log_stop();
     deinit();
 }
 
@@ -65,6 +74,7 @@ EXPORT void CALL DllAbout(HWND hParent)
 EXPORT void CALL DllConfig(HWND hParent)
 {
     dlog("DllConfig() call");
+    init_wait();
     con_open();
     config_window();
 }
@@ -83,31 +93,18 @@ EXPORT void CALL GetDllInfo(PLUGIN_INFO * PluginInfo)
     );
 }
 
-static inline void n64_analog(BUTTONS *Keys, int16_t x, int16_t y)
+static inline void n64_analog(const ConfigSnapshot *snap, int port, BUTTONS *Keys, int16_t x, int16_t y)
 {
-    x = ((int32_t)x * (int32_t)concfg.range) / 32767;
-    y = ((int32_t)y * (int32_t)concfg.range) / 32767;
+    const ControllerConfig *cfg = &snap->con[port];
+    int32_t range = cfg->range > 127 ? 127 : cfg->range;
 
-    if (concfg.is_clamped) {
-        int16_t lim_x = 80 - (int16_t)round(abs(sclamp(y, -70, 70)) / 7. - 1. / 7);
-        int16_t lim_y = 80 - (int16_t)round(abs(sclamp(x, -70, 70)) / 7. - 1. / 7);
+    x = ((int32_t)x * range) / 32767;
+    y = ((int32_t)y * range) / 32767;
 
-        if (lim_x < x) {
-            x = lim_x;
-            y = y * (lim_x / x);
-        }
-        if (-lim_x > x) {
-            x = -lim_x;
-            y = y * (-lim_x / x);
-        }
-        if (lim_y < y) {
-            y = lim_y;
-            x = x * (lim_y / y);
-        }
-        if (-lim_y > y) {
-            y = -lim_y;
-            x = x * (-lim_y / y);
-        }
+    if (cfg->is_clamped) {
+        const int8_t *gated = mapping_gate(&snap->prog[port], x, y);
+        x = gated[0];
+        y = gated[1];
     }
 
     Keys->Y_AXIS = x;
@@ -176,27 +173,27 @@ static int16_t get_state_buttonaxis(inputs_t *i, enum ButtonAxis ba)
     }
 }
 
-static int16_t get_state_mapping_button(inputs_t *i, ControllerMapping *mapping)
+static int16_t get_state_mapping_button(const ControllerConfig *cfg, inputs_t *i, const ControllerMapping *mapping)
 {
     int16_t p = get_state_buttonaxis(i, mapping->primary);
     int16_t s = get_state_buttonaxis(i, mapping->secondary);
 
     if (mapping->primary >= CONTROLLER_AXIS_BEGIN) {
-        float t = mapping->primary < CONTROLLER_LTRIG ? concfg.a2d_threshold 
-                                                      : concfg.a2d_trig;
+        float t = mapping->primary < CONTROLLER_LTRIG ? cfg->a2d_threshold 
+                                                      : cfg->a2d_trig;
         p = threshold(p, t) != 0;
     }
 
     if (mapping->secondary >= CONTROLLER_AXIS_BEGIN) {
-        float t = mapping->secondary < CONTROLLER_LTRIG ? concfg.a2d_threshold 
-                                                        : concfg.a2d_trig;
+        float t = mapping->secondary < CONTROLLER_LTRIG ? cfg->a2d_threshold 
+                                                        : cfg->a2d_trig;
         s = threshold(s, t) != 0;
     }
 
     return p || s;
 }
 
-static int16_t get_state_mapping_axis(inputs_t *i, ControllerMapping *plus, ControllerMapping *minus)
+static int16_t get_state_mapping_axis(inputs_t *i, const ControllerMapping *plus, const ControllerMapping *minus)
 {
     int16_t plus_p = get_state_buttonaxis(i, plus->primary);
     int16_t plus_s = get_state_buttonaxis(i, plus->secondary);
@@ -228,66 +225,239 @@ static int16_t get_state_mapping_axis(inputs_t *i, ControllerMapping *plus, Cont
     return axis;
 }
 
+/* reference mapping path, kept to check the compiled program against */
+static uint32_t get_keys_reference(const ControllerConfig *cfg, inputs_t *i, int16_t *x, int16_t *y)
+{
+    BUTTONS Keys = {0};
+
+    Keys.R_DPAD = get_state_mapping_button(cfg, i, &cfg->dright);
+    Keys.L_DPAD = get_state_mapping_button(cfg, i, &cfg->dleft);
+    Keys.D_DPAD = get_state_mapping_button(cfg, i, &cfg->ddown);
+    Keys.U_DPAD = get_state_mapping_button(cfg, i, &cfg->dup);
+    Keys.START_BUTTON = get_state_mapping_button(cfg, i, &cfg->start);
+    Keys.Z_TRIG = get_state_mapping_button(cfg, i, &cfg->z);
+    Keys.A_BUTTON = get_state_mapping_button(cfg, i, &cfg->a);
+    Keys.B_BUTTON = get_state_mapping_button(cfg, i, &cfg->b);
+
+    Keys.R_CBUTTON = get_state_mapping_button(cfg, i, &cfg->cright);
+    Keys.L_CBUTTON = get_state_mapping_button(cfg, i, &cfg->cleft);
+    Keys.D_CBUTTON = get_state_mapping_button(cfg, i, &cfg->cdown);
+    Keys.U_CBUTTON = get_state_mapping_button(cfg, i, &cfg->cup);
+    Keys.R_TRIG = get_state_mapping_button(cfg, i, &cfg->r);
+    Keys.L_TRIG = get_state_mapping_button(cfg, i, &cfg->l);
+
+    *x = get_state_mapping_axis(i, &cfg->right, &cfg->left);
+    *y = get_state_mapping_axis(i, &cfg->down, &cfg->up);
+
+    return Keys.Value;
+}
+
+static uint32_t analog_reference(const ConfigSnapshot *snap, int port, int16_t x, int16_t y)
+{
+    BUTTONS Keys = {0};
+
+    scale_and_limit(&x, &y, snap->con[port].deadzone, snap->con[port].outer_edge);
+    n64_analog(snap, port, &Keys, x, y);
+
+    return Keys.Value;
+}
+
+static void verify_mapping(const ControllerConfig *cfg, inputs_t *i, uint32_t value, int16_t x, int16_t y)
+{
+    static unsigned int mismatches;
+
+    int16_t ref_x, ref_y;
+    uint32_t ref_value = get_keys_reference(cfg, i, &ref_x, &ref_y);
+
+    if (ref_value == value && ref_x == x && ref_y == y) {
+        return;
+    }
+
+    // only log on powers of two so a persistent mismatch doesn't flood the log
+    ++mismatches;
+    if ((mismatches & (mismatches - 1)) == 0) {
+        dlog("Mapping mismatch #%u: compiled %04x (%d, %d), reference %04x (%d, %d)",
+            mismatches, value, x, y, ref_value, ref_x, ref_y);
+    }
+}
+
+static void verify_analog(const ConfigSnapshot *snap, int port, int16_t x, int16_t y, uint32_t value)
+{
+    static unsigned int mismatches;
+
+    uint32_t ref_value = analog_reference(snap, port, x, y);
+    if (ref_value == value) {
+        return;
+    }
+
+    // +-1 differences on boundary inputs are expected, see mapping_analog()
+    ++mismatches;
+    if ((mismatches & (mismatches - 1)) == 0) {
+        BUTTONS fixed = { .Value = value };
+        BUTTONS ref = { .Value = ref_value };
+        dlog("Analog mismatch #%u for (%d, %d): fixed-point (%d, %d), float (%d, %d)",
+            mismatches, x, y, fixed.X_AXIS, fixed.Y_AXIS, ref.X_AXIS, ref.Y_AXIS);
+    }
+}
+
+/* the last BUTTONS of each port, reused as long as the inputs and the
+   settings are still the generation they were mapped from. like the
+   input generations, only used by the thread reading inputs */
+typedef struct KeysCache
+{
+    int valid;
+    unsigned int input_gen;
+    unsigned int config_version;
+    uint16_t buttons;       // after latching, which changes them by itself
+    uint32_t value;
+} KeysCache;
+
+static KeysCache keys_cache[PORT_COUNT];
+
+static uint32_t map_port(const ConfigSnapshot *snap, int port, inputs_t *i, unsigned int gen, int new_frame)
+{
+    const ControllerConfig *cfg = &snap->con[port];
+    const MappingProgram *prog = &snap->prog[port];
+    uint32_t value;
+    int16_t x, y;
+
+    con_latch_inputs(cfg, port, i, new_frame);
+
+    KeysCache *cache = &keys_cache[port];
+    if (cache->valid && cache->input_gen == gen && cache->config_version == snap->version
+        && cache->buttons == i->buttons) {
+        stats_cache(1);
+        return cache->value;
+    }
+    stats_cache(0);
+
+    if (snap->plugin.reference_mapping) {
+        value = get_keys_reference(cfg, i, &x, &y);
+    } else {
+        value = mapping_run(prog, i, &x, &y);
+        if (snap->plugin.verify_mapping) {
+            verify_mapping(cfg, i, value, x, y);
+        }
+    }
+
+    if (snap->plugin.fixed_analog) {
+        uint32_t analog = mapping_analog(prog, x, y);
+        if (snap->plugin.verify_mapping) {
+            verify_analog(snap, port, x, y, analog);
+        }
+        value |= analog;
+    } else {
+        value |= analog_reference(snap, port, x, y);
+    }
+
+    *cache = (KeysCache){ 1, gen, snap->version, i->buttons, value };
+    return value;
+}
+
+/* one pass over all ports; ports without a controller read neutral.
+   the settings are whichever snapshot was current, edits in the config
+   window never block this */
+static void sample_ports(uint32_t values[PORT_COUNT], int new_frame)
+{
+    inputs_t i[PORT_COUNT] = {0};
+    unsigned int gen[PORT_COUNT];
+    uint32_t need[PORT_COUNT];
+
+    int epoch = epoch_enter();
+    const ConfigSnapshot *snap = snapshot_get();
+    // only fetch what the mappings read
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        need[port] = snap->prog[port].sources;
+    }
+    int mask = con_get_inputs(i, gen, need);
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        values[port] = mask & (1 << port) ? map_port(snap, port, &i[port], gen[port], new_frame) : 0;
+    }
+    epoch_exit(epoch);
+}
+
+/* without the sampler, GetKeys is called for each port in turn; all of
+   them are read from one pass, and a port coming back for another value
+   starts the next one */
+static uint32_t snapshot[PORT_COUNT];
+static int snapshot_read = (1 << PORT_COUNT) - 1;
+
+static uint32_t get_keys_direct(int port)
+{
+    if (snapshot_read & (1 << port)) {
+        sample_ports(snapshot, 1);
+        snapshot_read = 0;
+    }
+    snapshot_read |= 1 << port;
+    return snapshot[port];
+}
+
 EXPORT void CALL GetKeys(int Control, BUTTONS *Keys)
 {
-    inputs_t i = {0};
-    con_get_inputs(&i);
-
-    Keys->Value = 0;
-
-    EnterCriticalSection(&critical_section);
-
-    Keys->R_DPAD = get_state_mapping_button(&i, &concfg.dright);
-    Keys->L_DPAD = get_state_mapping_button(&i, &concfg.dleft);
-    Keys->D_DPAD = get_state_mapping_button(&i, &concfg.ddown);
-    Keys->U_DPAD = get_state_mapping_button(&i, &concfg.dup);
-    Keys->START_BUTTON = get_state_mapping_button(&i, &concfg.start);
-    Keys->Z_TRIG = get_state_mapping_button(&i, &concfg.z);
-    Keys->A_BUTTON = get_state_mapping_button(&i, &concfg.a);
-    Keys->B_BUTTON = get_state_mapping_button(&i, &concfg.b);
-
-    Keys->R_CBUTTON = get_state_mapping_button(&i, &concfg.cright);
-    Keys->L_CBUTTON = get_state_mapping_button(&i, &concfg.cleft);
-    Keys->D_CBUTTON = get_state_mapping_button(&i, &concfg.cdown);
-    Keys->U_CBUTTON = get_state_mapping_button(&i, &concfg.cup);
-    Keys->R_TRIG = get_state_mapping_button(&i, &concfg.r);
-    Keys->L_TRIG = get_state_mapping_button(&i, &concfg.l);
-
-    int16_t x = get_state_mapping_axis(&i, &concfg.right, &concfg.left);
-    int16_t y = get_state_mapping_axis(&i, &concfg.down, &concfg.up);
-    scale_and_limit(&x, &y, concfg.deadzone, concfg.outer_edge);
-
-    LeaveCriticalSection(&critical_section);
-
-    n64_analog(
-        Keys,
-        x,
-        y
-    );
+    if (Control < 0 || Control >= PORT_COUNT) {
+        Keys->Value = 0;
+        return;
+    }
+
+    int64_t start = stats_now();
+
+    Keys->Value = sampler_read(Control, get_keys_direct);
+
+    con_record_event_age();
+    stats_record_since(STAT_GETKEYS, start);
 }
 
 EXPORT void CALL InitiateControllers(HWND hMainWindow, CONTROL Controls[4])
 {
+    int epoch = epoch_enter();
+    const ConfigSnapshot *snap = snapshot_get();
     for (int i = 0; i < 4; ++i)
     {
-        Controls[i].Present = FALSE;
+        Controls[i].Present = i < PORT_COUNT && snap->con[i].plugged;
         Controls[i].RawData = FALSE;
     }
-    Controls[0].Present = TRUE;
+    epoch_exit(epoch);
+
+    // the writer thread is not started from DllMain: a thread created
+    // there can't be waited for at detach
+    log_start();
+
+    // SDL_Init can take a while enumerating HID devices, keep it off the
+    // emulator thread; GetKeys reads neutral input until it's done
+    init_async();
 }
 
 //EXPORT void CALL ReadController(int Control, BYTE * Command) {}
 
 EXPORT void CALL RomClosed(void) 
 {
-    // Project64 2.x and later: need a dummy function for this
-    // since it became mandatory for whatever reason...
+    // Project64 2.x and later: mandatory, also used to stop the sampler
+    sampler_close();
+
+    unsigned int presses, saved;
+    uint32_t shortest_tap;
+    con_latch_stats(&presses, &saved, &shortest_tap);
+    if (saved > 0) {
+        dlog("Latching kept %u of %u presses that would have been dropped (shortest %u ms)",
+            saved, presses, shortest_tap);
+    }
+
+    config_save_devices();
 }
 
 EXPORT void CALL RomOpen(void)
 {
     dlog("RomOpen() call");
-    con_open();
+    con_open_async();
+
+    int epoch = epoch_enter();
+    PluginConfig plugin = snapshot_get()->plugin;
+    epoch_exit(epoch);
+
+    sampler_set_rate(plugin.sampler_rate);
+    sampler_set_jit(plugin.jit_polling, plugin.jit_margin_us);
+
+    sampler_open(sample_ports);
 }
 
 //EXPORT void CALL WM_KeyDown(WPARAM wParam, LPARAM lParam) {}
@@ -8,24 +8,53 @@
 #include <stdio.h>
 #include <errno.h>
 #include "sdl_input.h"
+#include "snapshot.h"
+#include "devices.h"
 
-ControllerConfig concfg;
+ControllerConfig concfg[PORT_COUNT];
+PluginConfig plugcfg;
 char configpath[PATH_MAX] = "Config\\" PLUGIN_NAME ".ini";
 
 static const char suffix_primary[] = "_primary";
 static const char suffix_secondary[] = "_secondary";
 
+/* only used by the thread that loads the config, then the config window */
 ini_t *configini;
 
+/* held while the config file is read or written; the emulator thread
+   saves the device list while the config window may load or save */
+static SRWLOCK file_lock = SRWLOCK_INIT;
+
 static const ControllerConfigInfo concfg_field_info[] = {
+    { CONFIG_INT,     "plugged",       offsetof(ControllerConfig, plugged) },
+
     { CONFIG_FLOAT,   "deadzone",      offsetof(ControllerConfig, deadzone) },
     { CONFIG_FLOAT,   "outer_edge",    offsetof(ControllerConfig, outer_edge) },
     { CONFIG_INT,     "range",         offsetof(ControllerConfig, range) },
     { CONFIG_INT,     "is_clamped",    offsetof(ControllerConfig, is_clamped) },
+    { CONFIG_INT,     "gate_cardinal", offsetof(ControllerConfig, gate_cardinal) },
+    { CONFIG_INT,     "gate_diagonal", offsetof(ControllerConfig, gate_diagonal) },
 
     { CONFIG_FLOAT,   "a2d_threshold", offsetof(ControllerConfig, a2d_threshold) },
     { CONFIG_FLOAT,   "a2d_trig",      offsetof(ControllerConfig, a2d_trig) },
 
+    { CONFIG_INT,     "latching",         offsetof(ControllerConfig, latching) },
+    { CONFIG_INT,     "latch_a",          offsetof(ControllerConfig, latch_frames[0]) },
+    { CONFIG_INT,     "latch_b",          offsetof(ControllerConfig, latch_frames[1]) },
+    { CONFIG_INT,     "latch_x",          offsetof(ControllerConfig, latch_frames[2]) },
+    { CONFIG_INT,     "latch_y",          offsetof(ControllerConfig, latch_frames[3]) },
+    { CONFIG_INT,     "latch_back",       offsetof(ControllerConfig, latch_frames[4]) },
+    { CONFIG_INT,     "latch_guide",      offsetof(ControllerConfig, latch_frames[5]) },
+    { CONFIG_INT,     "latch_start",      offsetof(ControllerConfig, latch_frames[6]) },
+    { CONFIG_INT,     "latch_lstick",     offsetof(ControllerConfig, latch_frames[7]) },
+    { CONFIG_INT,     "latch_rstick",     offsetof(ControllerConfig, latch_frames[8]) },
+    { CONFIG_INT,     "latch_lshoulder",  offsetof(ControllerConfig, latch_frames[9]) },
+    { CONFIG_INT,     "latch_rshoulder",  offsetof(ControllerConfig, latch_frames[10]) },
+    { CONFIG_INT,     "latch_dup",        offsetof(ControllerConfig, latch_frames[11]) },
+    { CONFIG_INT,     "latch_ddown",      offsetof(ControllerConfig, latch_frames[12]) },
+    { CONFIG_INT,     "latch_dleft",      offsetof(ControllerConfig, latch_frames[13]) },
+    { CONFIG_INT,     "latch_dright",     offsetof(ControllerConfig, latch_frames[14]) },
+
     { CONFIG_MAPPING, "a",             offsetof(ControllerConfig, a) },
     { CONFIG_MAPPING, "b",             offsetof(ControllerConfig, b) },
     { CONFIG_MAPPING, "z",             offsetof(ControllerConfig, z) },
@@ -48,17 +77,40 @@ static const ControllerConfigInfo concfg_field_info[] = {
 
 static const int concfg_field_count = sizeof(concfg_field_info) / sizeof(concfg_field_info[0]);
 
-static void concfg_set_defaults(ControllerConfig *cfg)
+static const ControllerConfigInfo plugcfg_field_info[] = {
+    { CONFIG_INT,     "sampler_rate",      offsetof(PluginConfig, sampler_rate) },
+    { CONFIG_INT,     "jit_polling",       offsetof(PluginConfig, jit_polling) },
+    { CONFIG_INT,     "jit_margin_us",     offsetof(PluginConfig, jit_margin_us) },
+    { CONFIG_INT,     "event_inputs",      offsetof(PluginConfig, event_inputs) },
+
+    { CONFIG_INT,     "reference_mapping", offsetof(PluginConfig, reference_mapping) },
+    { CONFIG_INT,     "verify_mapping",    offsetof(PluginConfig, verify_mapping) },
+    { CONFIG_INT,     "fixed_analog",      offsetof(PluginConfig, fixed_analog) },
+
+    { CONFIG_INT,     "gui_fps",           offsetof(PluginConfig, gui_fps) },
+};
+
+static const int plugcfg_field_count = sizeof(plugcfg_field_info) / sizeof(plugcfg_field_info[0]);
+
+static void concfg_set_defaults(ControllerConfig *cfg, int port)
 {
     // default values
+    cfg->plugged = port == 0;
     cfg->deadzone = 0.05;
     cfg->range = 80;
     cfg->outer_edge = 0.95;
     cfg->is_clamped = 0;
+    cfg->gate_cardinal = 80;
+    cfg->gate_diagonal = 70;
 
     cfg->a2d_threshold = 0.25;
     cfg->a2d_trig = 0.25;
 
+    cfg->latching = 0;
+    for (int i = 0; i < CONTROLLER_BUTTON_COUNT; ++i) {
+        cfg->latch_frames[i] = 1;
+    }
+
     // default controls
     cfg->a.primary        = CONTROLLER_A;
     cfg->a.secondary      = CONTROLLER_B;
@@ -89,6 +141,24 @@ static void concfg_set_defaults(ControllerConfig *cfg)
     cfg->right.primary    = CONTROLLER_LEFTX;
 }
 
+static void plugcfg_set_defaults(PluginConfig *cfg)
+{
+    // 0 = sample on the emulator thread inside GetKeys
+    cfg->sampler_rate = 0;
+    // 0 = sample on a fixed timer even once the GetKeys cadence is known
+    cfg->jit_polling = 0;
+    cfg->jit_margin_us = 500;
+    // 0 = read every button and axis from SDL on each poll
+    cfg->event_inputs = 0;
+
+    cfg->reference_mapping = 0;
+    cfg->verify_mapping = 0;
+    cfg->fixed_analog = 1;
+
+    // 0 = no frame cap for the config window
+    cfg->gui_fps = 60;
+}
+
 static ini_t *ini_load_file(FILE *f)
 {
     fseek(f, 0, SEEK_END);
@@ -102,8 +172,6 @@ static ini_t *ini_load_file(FILE *f)
         fread(data, 1, size, f);
         data[size] = '\0';
 
-        fclose(f);
-
         ini = ini_load(data, NULL);
 
         free(data);
@@ -203,20 +271,20 @@ static void read_property_mapping(ini_t *ini, int section_n, const char property
     val->secondary = read_property_int(ini, section_n, property_buf, val->secondary);
 }
 
-static void config_load_con(ControllerConfig *cfg, ini_t *ini, char con_id)
+static int config_find_section(ini_t *ini, const char section[])
 {
-    // find section
-    char section[] = {"controller_0"};
-    section[strlen(section) - 1] = con_id;
-
     int section_n = ini_find_section(ini, section, 0);
     if (section_n == INI_NOT_FOUND) {
         section_n = ini_section_add(ini, section, 0);
     }
+    return section_n;
+}
 
+static void config_load_fields(void *cfg, ini_t *ini, int section_n, const ControllerConfigInfo info[], int count)
+{
     // read properties
-    for (int i = 0; i < concfg_field_count; ++i) {
-        ControllerConfigInfo field = concfg_field_info[i];
+    for (int i = 0; i < count; ++i) {
+        ControllerConfigInfo field = info[i];
 
         void *p = (void*)cfg + field.struct_offset;
 
@@ -237,25 +305,13 @@ static void config_load_con(ControllerConfig *cfg, ini_t *ini, char con_id)
                 break;
         }
     }
-
-    return;
 }
 
-
-static void config_save_con(ControllerConfig *cfg, ini_t *ini, char con_id)
+static void config_save_fields(void *cfg, ini_t *ini, int section_n, const ControllerConfigInfo info[], int count)
 {
-    // find section
-    char section[] = {"controller_0"};
-    section[strlen(section) - 1] = con_id;
-
-    int section_n = ini_find_section(ini, section, 0);
-    if (section_n == INI_NOT_FOUND) {
-        section_n = ini_section_add(ini, section, 0);
-    }
-
     // save properties
-    for (int i = 0; i < concfg_field_count; ++i) {
-        ControllerConfigInfo field = concfg_field_info[i];
+    for (int i = 0; i < count; ++i) {
+        ControllerConfigInfo field = info[i];
 
         void *p = (void*)cfg + field.struct_offset;
 
@@ -276,59 +332,198 @@ static void config_save_con(ControllerConfig *cfg, ini_t *ini, char con_id)
                 break;
         }
     }
+}
+
+static void config_load_con(ControllerConfig *cfg, ini_t *ini, int port)
+{
+    // find section
+    char section[] = {"controller_0"};
+    section[strlen(section) - 1] = '0' + port;
+
+    int section_n = config_find_section(ini, section);
+    config_load_fields(cfg, ini, section_n, concfg_field_info, concfg_field_count);
+}
+
+static void config_save_con(ControllerConfig *cfg, ini_t *ini, int port)
+{
+    // find section
+    char section[] = {"controller_0"};
+    section[strlen(section) - 1] = '0' + port;
+
+    int section_n = config_find_section(ini, section);
+    config_save_fields(cfg, ini, section_n, concfg_field_info, concfg_field_count);
+}
 
-    return;
+static void config_load_plugin(PluginConfig *cfg, ini_t *ini)
+{
+    int section_n = config_find_section(ini, "plugin");
+    config_load_fields(cfg, ini, section_n, plugcfg_field_info, plugcfg_field_count);
+}
+
+static void config_save_plugin(PluginConfig *cfg, ini_t *ini)
+{
+    int section_n = config_find_section(ini, "plugin");
+    config_save_fields(cfg, ini, section_n, plugcfg_field_info, plugcfg_field_count);
+}
+
+static void config_load_devices(ini_t *ini)
+{
+    int section_n = config_find_section(ini, "devices");
+
+    devices_clear();
+    for (int i = 0; i < DEVICES_MAX; ++i) {
+        char property[32];
+        snprintf(property, sizeof(property), "device_%d", i);
+
+        int prop_n = ini_find_property(ini, section_n, property, 0);
+        if (prop_n != INI_NOT_FOUND) {
+            const char *key = ini_property_value(ini, section_n, prop_n);
+
+            // stored 1-based, 0 = any port
+            snprintf(property, sizeof(property), "device_%d_port", i);
+            prop_n = ini_find_property(ini, section_n, property, 0);
+            int port = prop_n != INI_NOT_FOUND ? atoi(ini_property_value(ini, section_n, prop_n)) : 0;
+
+            devices_load_key(key, port >= 1 && port <= PORT_COUNT ? port - 1 : -1);
+        }
+    }
+    devices_changed();
+}
+
+static void config_save_devices_section(ini_t *ini)
+{
+    int section_n = config_find_section(ini, "devices");
+
+    for (int i = 0; i < DEVICES_MAX; ++i) {
+        char property[32];
+        char port_property[32];
+        char key[192];
+        int port;
+        snprintf(property, sizeof(property), "device_%d", i);
+        snprintf(port_property, sizeof(port_property), "device_%d_port", i);
+
+        if (devices_key(i, key, sizeof(key), &port)) {
+            set_property(ini, section_n, property, key);
+            set_property_int(ini, section_n, port_property, port + 1);
+        } else {
+            int prop_n = ini_find_property(ini, section_n, property, 0);
+            if (prop_n != INI_NOT_FOUND) {
+                ini_property_remove(ini, section_n, prop_n);
+            }
+            prop_n = ini_find_property(ini, section_n, port_property, 0);
+            if (prop_n != INI_NOT_FOUND) {
+                ini_property_remove(ini, section_n, prop_n);
+            }
+        }
+    }
+}
+
+static void config_write(ini_t *ini)
+{
+    int size = ini_save(ini, NULL, 0);
+    char *data = (char*) malloc(size);
+    size = ini_save(ini, data, size);
+
+    FILE *configfile = fopen(configpath, "wb");
+    if (configfile == NULL) {
+        dlog("Unable to save config file %s: %s", configpath, strerror(errno));
+    } else {
+        fwrite(data, 1, size, configfile);
+        fclose(configfile);
+        dlog("Saved config file %s", configpath);
+    }
+
+    free(data);
 }
 
 void config_load()
 {
+    AcquireSRWLockExclusive(&file_lock);
     FILE *configfile = fopen(configpath, "rb");
     if (configini != NULL) {
         ini_destroy(configini);
     }
     if (configfile != NULL) {
         configini = ini_load_file(configfile);
+        fclose(configfile);
         dlog("Loaded config file %s", configpath);
     } else {
         configini = ini_create(0);
         dlog("Unable to open config file %s: %s", configpath, strerror(errno));
     }
-    fclose(configfile);
 
-    config_load_con(&concfg, configini, '0');
+    config_load_plugin(&plugcfg, configini);
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        config_load_con(&concfg[port], configini, port);
+    }
+    config_load_devices(configini);
+    ReleaseSRWLockExclusive(&file_lock);
+
+    config_changed();
 }
 
 void config_save()
 {
-    if (configini == NULL) {
+    int loaded = configini != NULL;
+    if (!loaded) {
         config_initialize();
-    } else {
-        config_save_con(&concfg, configini, '0');
     }
 
-    int size = ini_save(configini, NULL, 0);
-    char *data = (char*) malloc(size);
-    size = ini_save(configini, data, size);
+    AcquireSRWLockExclusive(&file_lock);
+    if (loaded) {
+        config_save_plugin(&plugcfg, configini);
+        for (int port = 0; port < PORT_COUNT; ++port) {
+            config_save_con(&concfg[port], configini, port);
+        }
+        config_save_devices_section(configini);
+        devices_changed();
+    }
 
-    FILE *configfile = fopen(configpath, "wb");
-    if (configfile == NULL) {
-        dlog("Unable to save config file %s: %s", configpath, strerror(errno));
-    } else {
-        fwrite(data, 1, size, configfile);
+    config_write(configini);
+    ReleaseSRWLockExclusive(&file_lock);
+}
+
+/* writes out just the device list, leaving unsaved settings alone. called
+   from the emulator thread, so it works on the file as it is on disk and
+   never touches configini */
+void config_save_devices()
+{
+    if (!devices_changed()) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&file_lock);
+    ini_t *ini;
+    FILE *configfile = fopen(configpath, "rb");
+    if (configfile != NULL) {
+        ini = ini_load_file(configfile);
         fclose(configfile);
-        dlog("Saved config file %s", configpath);
+    } else {
+        ini = ini_create(0);
     }
 
-    free(data);
+    config_save_devices_section(ini);
+    config_write(ini);
+    ini_destroy(ini);
+    ReleaseSRWLockExclusive(&file_lock);
+}
+
+void config_changed()
+{
+    snapshot_publish(concfg, &plugcfg);
 }
 
 void config_initialize()
 {
-    concfg_set_defaults(&concfg);
+    plugcfg_set_defaults(&plugcfg);
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        concfg_set_defaults(&concfg[port], port);
+    }
     config_load();
 }
 
 void config_deinit()
 {
     ini_destroy(configini);
+    snapshot_free();
 }
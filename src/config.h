@@ -2,10 +2,15 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#ifndef OCTOMINO_CONFIG_H_
+#define OCTOMINO_CONFIG_H_
+
 #include <stdio.h>
 
 #define CONTROLLER_AXIS_BEGIN CONTROLLER_LEFTX
 
+#define PORT_COUNT 4
+
 enum ButtonAxis
 {
     CONTROLLER_NOT_SET,
@@ -40,6 +45,8 @@ enum ButtonAxis
     CONTROLLER_ENUM_END,
 };
 
+#define CONTROLLER_BUTTON_COUNT (CONTROLLER_AXIS_BEGIN - CONTROLLER_A)
+
 enum ConfigType
 {
     CONFIG_INT,
@@ -55,14 +62,23 @@ typedef struct ControlllerMapping
 
 typedef struct ControllerConfig 
 {
+    // whether the emulator is told a controller is connected to this port
+    int plugged;
+
     float deadzone;
     float outer_edge;
     unsigned int range;
     int is_clamped;
+    unsigned int gate_cardinal;
+    unsigned int gate_diagonal;
 
     float a2d_threshold;
     float a2d_trig;
 
+    // minimum frames a press is reported for, per controller button
+    int latching;
+    unsigned int latch_frames[CONTROLLER_BUTTON_COUNT];
+
     ControllerMapping a;
     ControllerMapping b;
     ControllerMapping z;
@@ -86,6 +102,20 @@ typedef struct ControllerConfig
     ControllerMapping right;
 } ControllerConfig;
 
+typedef struct PluginConfig
+{
+    unsigned int sampler_rate;
+    int jit_polling;
+    unsigned int jit_margin_us;
+    int event_inputs;
+
+    int reference_mapping;
+    int verify_mapping;
+    int fixed_analog;
+
+    unsigned int gui_fps;
+} PluginConfig;
+
 typedef struct ControllerConfigInfo
 {
     enum ConfigType type;
@@ -93,11 +123,18 @@ typedef struct ControllerConfigInfo
     int struct_offset;
 } ControllerConfigInfo;
 
-extern ControllerConfig concfg;
+/* the copy edited by the config window and loaded from/saved to the file;
+   the input path reads the published snapshot instead, see snapshot.h */
+extern ControllerConfig concfg[PORT_COUNT];
+extern PluginConfig plugcfg;
 
 extern char configpath[];
 
 void config_load();
 void config_save();
+void config_save_devices();
 void config_initialize();
 void config_deinit();
+void config_changed();
+
+#endif
@@ -0,0 +1,250 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices.h"
+
+#define DEVICE_SLOTS 16     // power of two, at least twice DEVICES_MAX
+
+typedef struct DeviceKey
+{
+    SDL_JoystickGUID guid;
+    char ident[128];
+    int port;               // port the device is bound to, -1 for any
+} DeviceKey;
+
+typedef struct DeviceSlot
+{
+    SDL_JoystickGUID guid;
+    int used;               // best rank with this GUID plus one, 0 if empty
+    int port;               // ...and its port
+} DeviceSlot;
+
+static SRWLOCK devices_lock = SRWLOCK_INIT;
+static DeviceKey devices[DEVICES_MAX];
+static int count;
+static DeviceSlot slots[DEVICE_SLOTS];
+static atomic_int changed;
+
+static uint32_t guid_hash(const SDL_JoystickGUID *guid)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 16; ++i) {
+        h = (h ^ guid->data[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* called with the lock held exclusively whenever the list changes */
+static void rebuild_slots(void)
+{
+    memset(slots, 0, sizeof(slots));
+
+    // in rank order, so each GUID's slot keeps its best rank
+    for (int rank = 0; rank < count; ++rank) {
+        uint32_t h = guid_hash(&devices[rank].guid) & (DEVICE_SLOTS - 1);
+        while (slots[h].used
+               && memcmp(&slots[h].guid, &devices[rank].guid, sizeof(SDL_JoystickGUID))) {
+            h = (h + 1) & (DEVICE_SLOTS - 1);
+        }
+        if (!slots[h].used) {
+            slots[h].guid = devices[rank].guid;
+            slots[h].used = rank + 1;
+            slots[h].port = devices[rank].port;
+        }
+    }
+}
+
+static int find_locked(const SDL_JoystickGUID *guid, const char *ident)
+{
+    for (int i = 0; i < count; ++i) {
+        if (!memcmp(&devices[i].guid, guid, sizeof(*guid))
+            && !strcmp(devices[i].ident, ident)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void device_info_read(DeviceInfo *info, SDL_GameController *c)
+{
+    SDL_Joystick *joy = SDL_GameControllerGetJoystick(c);
+
+    info->guid = SDL_JoystickGetGUID(joy);
+    SDL_JoystickGetGUIDString(info->guid, info->guid_str, sizeof(info->guid_str));
+
+    const char *ident = NULL;
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    ident = SDL_JoystickGetSerial(joy);
+#endif
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    if (ident == NULL || ident[0] == '\0') {
+        ident = SDL_JoystickPath(joy);
+    }
+#endif
+    snprintf(info->ident, sizeof(info->ident), "%s", ident != NULL ? ident : "");
+
+    const char *name = SDL_GameControllerName(c);
+    snprintf(info->name, sizeof(info->name), "%s", name != NULL ? name : "");
+
+    char *mapping = SDL_GameControllerMapping(c);
+    snprintf(info->mapping, sizeof(info->mapping), "%s", mapping != NULL ? mapping : "");
+    SDL_free(mapping);
+}
+
+/* rank of a device that isn't open yet, and the port it's bound to */
+int devices_rank(int device_index, int *port)
+{
+    SDL_JoystickGUID guid = SDL_JoystickGetDeviceGUID(device_index);
+    uint32_t h = guid_hash(&guid) & (DEVICE_SLOTS - 1);
+    int rank = -1;
+    *port = -1;
+
+    AcquireSRWLockShared(&devices_lock);
+    while (slots[h].used) {
+        if (!memcmp(&slots[h].guid, &guid, sizeof(guid))) {
+            rank = slots[h].used - 1;
+            *port = slots[h].port;
+            break;
+        }
+        h = (h + 1) & (DEVICE_SLOTS - 1);
+    }
+    ReleaseSRWLockShared(&devices_lock);
+
+    return rank;
+}
+
+int devices_find(const DeviceInfo *info)
+{
+    AcquireSRWLockShared(&devices_lock);
+    int rank = find_locked(&info->guid, info->ident);
+    ReleaseSRWLockShared(&devices_lock);
+    return rank;
+}
+
+static int add_locked(const SDL_JoystickGUID *guid, const char *ident)
+{
+    int rank = find_locked(guid, ident);
+    if (rank != -1) {
+        return rank;
+    }
+
+    // a full list forgets its least preferred device
+    rank = count < DEVICES_MAX ? count++ : DEVICES_MAX - 1;
+    devices[rank].guid = *guid;
+    snprintf(devices[rank].ident, sizeof(devices[rank].ident), "%s", ident);
+    devices[rank].port = -1;
+    rebuild_slots();
+    atomic_store(&changed, 1);
+    return rank;
+}
+
+int devices_add(const DeviceInfo *info)
+{
+    AcquireSRWLockExclusive(&devices_lock);
+    int rank = add_locked(&info->guid, info->ident);
+    ReleaseSRWLockExclusive(&devices_lock);
+    return rank;
+}
+
+void devices_prefer(const DeviceInfo *info)
+{
+    AcquireSRWLockExclusive(&devices_lock);
+    int rank = add_locked(&info->guid, info->ident);
+    if (rank > 0) {
+        DeviceKey key = devices[rank];
+        memmove(&devices[1], &devices[0], sizeof(devices[0]) * rank);
+        devices[0] = key;
+        rebuild_slots();
+        atomic_store(&changed, 1);
+    }
+    ReleaseSRWLockExclusive(&devices_lock);
+}
+
+int devices_get_port(const DeviceInfo *info)
+{
+    AcquireSRWLockShared(&devices_lock);
+    int rank = find_locked(&info->guid, info->ident);
+    int port = rank != -1 ? devices[rank].port : -1;
+    ReleaseSRWLockShared(&devices_lock);
+    return port;
+}
+
+void devices_set_port(const DeviceInfo *info, int port)
+{
+    AcquireSRWLockExclusive(&devices_lock);
+    int rank = add_locked(&info->guid, info->ident);
+    if (devices[rank].port != port) {
+        devices[rank].port = port;
+        rebuild_slots();
+        atomic_store(&changed, 1);
+    }
+    ReleaseSRWLockExclusive(&devices_lock);
+}
+
+int devices_count(void)
+{
+    AcquireSRWLockShared(&devices_lock);
+    int n = count;
+    ReleaseSRWLockShared(&devices_lock);
+    return n;
+}
+
+int devices_key(int rank, char *buf, int size, int *port)
+{
+    int found = 0;
+
+    AcquireSRWLockShared(&devices_lock);
+    if (rank >= 0 && rank < count) {
+        char guid_str[33];
+        SDL_JoystickGetGUIDString(devices[rank].guid, guid_str, sizeof(guid_str));
+        snprintf(buf, size, "%s/%s", guid_str, devices[rank].ident);
+        *port = devices[rank].port;
+        found = 1;
+    }
+    ReleaseSRWLockShared(&devices_lock);
+
+    return found;
+}
+
+void devices_load_key(const char *key, int port)
+{
+    const char *sep = strchr(key, '/');
+    size_t len = sep != NULL ? (size_t)(sep - key) : strlen(key);
+    if (len != 32) {
+        return;
+    }
+
+    char guid_str[33];
+    memcpy(guid_str, key, len);
+    guid_str[len] = '\0';
+    SDL_JoystickGUID guid = SDL_JoystickGetGUIDFromString(guid_str);
+
+    AcquireSRWLockExclusive(&devices_lock);
+    int rank = add_locked(&guid, sep != NULL ? sep + 1 : "");
+    devices[rank].port = port;
+    rebuild_slots();
+    ReleaseSRWLockExclusive(&devices_lock);
+}
+
+void devices_clear(void)
+{
+    AcquireSRWLockExclusive(&devices_lock);
+    count = 0;
+    rebuild_slots();
+    ReleaseSRWLockExclusive(&devices_lock);
+}
+
+/* whether the list changed since it was last saved or loaded */
+int devices_changed(void)
+{
+    return atomic_exchange(&changed, 0);
+}
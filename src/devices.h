@@ -0,0 +1,46 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_DEVICES_H_
+#define OCTOMINO_DEVICES_H_
+
+#include <SDL2/SDL_gamecontroller.h>
+
+/* Registry of the controllers that have been used, in order of preference.
+   Devices are keyed by GUID plus serial number (or device path) where SDL
+   has one, so two identical pads stay apart. A device may be bound to an
+   N64 port; several devices bound to one port are merged. A hash on the
+   GUID gives the rank and port of a newly added device from its index,
+   without opening it. The list is kept in the [devices] section of the
+   config file. */
+
+#define DEVICES_MAX 8
+
+typedef struct DeviceInfo
+{
+    SDL_JoystickGUID guid;
+    char guid_str[33];
+    char ident[128];        // serial, else device path, else empty
+    char name[128];
+    char mapping[1024];
+} DeviceInfo;
+
+/* fills in everything once, at open */
+void device_info_read(DeviceInfo *info, SDL_GameController *c);
+
+int devices_rank(int device_index, int *port);
+int devices_find(const DeviceInfo *info);
+int devices_add(const DeviceInfo *info);
+void devices_prefer(const DeviceInfo *info);
+int devices_get_port(const DeviceInfo *info);
+void devices_set_port(const DeviceInfo *info, int port);
+int devices_count(void);
+
+/* "guid/ident" strings and bound ports, for the config file */
+int devices_key(int rank, char *buf, int size, int *port);
+void devices_load_key(const char *key, int port);
+void devices_clear(void);
+int devices_changed(void);
+
+#endif
@@ -0,0 +1,174 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+#define EPOCH_SLOTS 32      // power of two, readers active at the same time
+#define EPOCH_RESERVE 16    // retire records for readers when malloc fails
+
+/* the epoch a reader entered at, 0 while the slot is free; one cache
+   line each so readers on different threads don't share one */
+typedef struct EpochSlot
+{
+    _Atomic uint64_t epoch;
+    char pad[64 - sizeof(uint64_t)];
+} EpochSlot;
+
+typedef struct Retired
+{
+    struct Retired *next;
+    void *p;
+    void (*destroy)(void *p);
+    uint64_t epoch;         // readers that entered after this can't see it
+    int reserved;           // from reserve, goes back there instead of free
+} Retired;
+
+static _Atomic uint64_t global_epoch = 1;
+static EpochSlot slots[EPOCH_SLOTS];
+static _Thread_local int slot_hint;
+static _Thread_local int depth;     // epochs this thread is inside of
+
+static SRWLOCK retired_lock = SRWLOCK_INIT;
+static Retired *retired;
+
+// guarded by retired_lock
+static Retired reserve[EPOCH_RESERVE];
+static int reserve_used[EPOCH_RESERVE];
+
+/* the returned slot goes back to epoch_exit(). a reader announces the
+   epoch before loading any pointer, so a writer that swapped the pointer
+   earlier either sees the reader, or the reader sees the new pointer */
+int epoch_enter(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    for (;;) {
+        for (int n = 0; n < EPOCH_SLOTS; ++n) {
+            int i = (slot_hint + n) & (EPOCH_SLOTS - 1);
+            uint64_t expected = 0;
+            if (atomic_load_explicit(&slots[i].epoch, memory_order_relaxed) == 0
+                && atomic_compare_exchange_strong(&slots[i].epoch, &expected, epoch)) {
+                // keep the caller's loads from moving ahead of the store
+                atomic_thread_fence(memory_order_seq_cst);
+                slot_hint = i;
+                ++depth;
+                return i;
+            }
+        }
+        // more readers at once than there are slots, let one of them leave
+        SwitchToThread();
+    }
+}
+
+void epoch_exit(int slot)
+{
+    --depth;
+    atomic_store_explicit(&slots[slot].epoch, 0, memory_order_release);
+}
+
+/* call after p can no longer be reached by a new reader. without memory
+   for the record, waits for the readers and destroys p right away; a
+   reader can't wait for itself, so it takes a reserved record instead */
+void epoch_retire(void *p, void (*destroy)(void *p))
+{
+    Retired *r = malloc(sizeof(*r));
+    if (r == NULL && depth == 0) {
+        epoch_synchronize();
+        destroy(p);
+        return;
+    }
+
+    AcquireSRWLockExclusive(&retired_lock);
+    if (r == NULL) {
+        for (int i = 0; i < EPOCH_RESERVE && r == NULL; ++i) {
+            if (!reserve_used[i]) {
+                reserve_used[i] = 1;
+                r = &reserve[i];
+            }
+        }
+        if (r == NULL) {
+            // nothing left: p stays around for good rather than be freed
+            // under a reader
+            ReleaseSRWLockExclusive(&retired_lock);
+            return;
+        }
+        r->reserved = 1;
+    } else {
+        r->reserved = 0;
+    }
+    r->p = p;
+    r->destroy = destroy;
+    r->epoch = atomic_fetch_add(&global_epoch, 1);
+    r->next = retired;
+    retired = r;
+    ReleaseSRWLockExclusive(&retired_lock);
+
+    epoch_reclaim();
+}
+
+/* destroys whatever no reader can still hold */
+void epoch_reclaim(void)
+{
+    Retired *done = NULL;
+
+    AcquireSRWLockExclusive(&retired_lock);
+
+    // scanned with the lock held, so everything on the list was retired
+    // before the scan and any reader still holding it shows up
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < EPOCH_SLOTS; ++i) {
+        uint64_t epoch = atomic_load(&slots[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    Retired **link = &retired;
+    while (*link != NULL) {
+        Retired *r = *link;
+        if (r->epoch < oldest) {
+            *link = r->next;
+            r->next = done;
+            done = r;
+        } else {
+            link = &r->next;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&retired_lock);
+
+    while (done != NULL) {
+        Retired *next = done->next;
+        done->destroy(done->p);
+        if (done->reserved) {
+            AcquireSRWLockExclusive(&retired_lock);
+            reserve_used[done - reserve] = 0;
+            ReleaseSRWLockExclusive(&retired_lock);
+        } else {
+            free(done);
+        }
+        done = next;
+    }
+}
+
+/* waits until every reader that is inside now has left, then reclaims.
+   not to be called by a reader, or with a lock held that readers take */
+void epoch_synchronize(void)
+{
+    uint64_t epoch = atomic_fetch_add(&global_epoch, 1) + 1;
+
+    for (int i = 0; i < EPOCH_SLOTS; ++i) {
+        uint64_t e;
+        while ((e = atomic_load(&slots[i].epoch)) != 0 && e < epoch) {
+            SwitchToThread();
+        }
+    }
+
+    epoch_reclaim();
+}
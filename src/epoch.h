@@ -0,0 +1,20 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_EPOCH_H_
+#define OCTOMINO_EPOCH_H_
+
+/* Epoch-based reclamation for objects that are read without a lock.
+   Readers bracket their use with epoch_enter() and epoch_exit(); a writer
+   that has swapped an object out hands it to epoch_retire(), and it is
+   destroyed once every reader that could still be looking at it has
+   left. Entering and leaving never wait on a writer. */
+
+int epoch_enter(void);
+void epoch_exit(int slot);
+void epoch_retire(void *p, void (*destroy)(void *p));
+void epoch_reclaim(void);
+void epoch_synchronize(void);
+
+#endif
@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "events.h"
+
+#define EVENT_QUEUE_SIZE 256    // power of two
+#define EVENT_BATCH      32
+
+typedef struct EventQueue
+{
+    _Atomic uint32_t head;      // written by the pump owner
+    _Atomic uint32_t tail;      // written by the subscriber
+    atomic_int enabled;
+    atomic_uint dropped;
+    HANDLE wake;                // set when events are added, for events_wait
+    SDL_Event ring[EVENT_QUEUE_SIZE];
+} EventQueue;
+
+static EventQueue queues[EVENTS_SUBSCRIBERS];
+
+/* held by whichever thread is draining SDL's queue */
+static atomic_flag pumping = ATOMIC_FLAG_INIT;
+
+static int route(Uint32 type)
+{
+    // SDL_JOY* and SDL_CONTROLLER* events sit between 0x600 and 0x700;
+    // everything below is application, window, keyboard and mouse
+    if (type >= SDL_JOYAXISMOTION && type < SDL_FINGERDOWN) {
+        return EVENTS_INPUT;
+    }
+    if (type < SDL_JOYAXISMOTION) {
+        return EVENTS_GUI;
+    }
+    return -1;
+}
+
+static int queue_push(EventQueue *q, const SDL_Event *e)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= EVENT_QUEUE_SIZE) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    q->ring[head & (EVENT_QUEUE_SIZE - 1)] = *e;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+void events_subscribe(EventSubscriber sub, int enabled)
+{
+    EventQueue *q = &queues[sub];
+    if (enabled && q->wake == NULL) {
+        q->wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    }
+
+    // anything queued while nobody was listening is stale
+    atomic_store(&q->tail, atomic_load(&q->head));
+    atomic_store_explicit(&q->enabled, enabled, memory_order_release);
+}
+
+/* Drains SDL's queue into the subscribers' rings. SDL_PumpEvents runs on
+   every caller, since window messages only arrive on the thread that
+   created the window; draining is skipped while another thread does it,
+   its pass delivers to every subscriber anyway. */
+void events_pump(void)
+{
+    SDL_PumpEvents();
+
+    if (atomic_flag_test_and_set_explicit(&pumping, memory_order_acquire)) {
+        return;
+    }
+
+    int woken[EVENTS_SUBSCRIBERS] = {0};
+    SDL_Event batch[EVENT_BATCH];
+    int count;
+    do {
+        count = SDL_PeepEvents(batch, EVENT_BATCH, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT);
+        for (int i = 0; i < count; ++i) {
+            int sub = route(batch[i].type);
+            if (sub != -1 && atomic_load_explicit(&queues[sub].enabled, memory_order_acquire)) {
+                woken[sub] |= queue_push(&queues[sub], &batch[i]);
+            }
+        }
+    } while (count == EVENT_BATCH);
+
+    atomic_flag_clear_explicit(&pumping, memory_order_release);
+
+    for (int sub = 0; sub < EVENTS_SUBSCRIBERS; ++sub) {
+        if (woken[sub] && queues[sub].wake != NULL) {
+            SetEvent(queues[sub].wake);
+        }
+    }
+}
+
+int events_next(EventSubscriber sub, SDL_Event *e)
+{
+    EventQueue *q = &queues[sub];
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) {
+        return 0;
+    }
+
+    *e = q->ring[tail & (EVENT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int events_pending(EventSubscriber sub)
+{
+    EventQueue *q = &queues[sub];
+    return atomic_load_explicit(&q->head, memory_order_acquire)
+        != atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+/* pumps until the subscriber has an event, or the timeout passes. window
+   messages for the calling thread also end the wait, so they get pumped */
+int events_wait(EventSubscriber sub, unsigned int timeout_ms)
+{
+    EventQueue *q = &queues[sub];
+    uint32_t start = SDL_GetTicks();
+
+    for (;;) {
+        events_pump();
+        if (atomic_load_explicit(&q->head, memory_order_acquire)
+            != atomic_load_explicit(&q->tail, memory_order_relaxed)) {
+            return 1;
+        }
+
+        uint32_t waited = SDL_GetTicks() - start;
+        if (waited >= timeout_ms) {
+            return 0;
+        }
+
+        // joystick events are queued by SDL's own threads without waking
+        // us, so don't sleep for long at a time
+        DWORD wait = timeout_ms - waited < 10 ? timeout_ms - waited : 10;
+        if (q->wake != NULL) {
+            MsgWaitForMultipleObjects(1, &q->wake, FALSE, wait, QS_ALLINPUT);
+        } else {
+            Sleep(wait);
+        }
+    }
+}
+
+unsigned int events_dropped(EventSubscriber sub)
+{
+    return atomic_exchange_explicit(&queues[sub].dropped, 0, memory_order_relaxed);
+}
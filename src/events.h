@@ -0,0 +1,31 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_EVENTS_H_
+#define OCTOMINO_EVENTS_H_
+
+#include <SDL2/SDL.h>
+
+/* Single owner of SDL's event queue. Whichever thread pumps first drains
+   it and hands every event to the queue of the side that wants it:
+   joystick and controller events go to the input path, window, mouse
+   and keyboard events to the config window. Each side only reads its
+   own single-producer single-consumer ring, so neither can steal the
+   other's events and reading never takes a lock. */
+
+typedef enum EventSubscriber
+{
+    EVENTS_INPUT,
+    EVENTS_GUI,
+    EVENTS_SUBSCRIBERS
+} EventSubscriber;
+
+void events_subscribe(EventSubscriber sub, int enabled);
+void events_pump(void);
+int events_next(EventSubscriber sub, SDL_Event *e);
+int events_pending(EventSubscriber sub);
+int events_wait(EventSubscriber sub, unsigned int timeout_ms);
+unsigned int events_dropped(EventSubscriber sub);
+
+#endif
@@ -0,0 +1,411 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <Shlwapi.h>
+#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gcdb.h"
+#include "sdl_input.h"
+
+#define GCDB_MAGIC   "OCTOGCDB"
+#define GCDB_VERSION 3
+
+typedef struct GcdbHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t named_count;   // entries after the sorted ones, see build_index
+    uint64_t source_size;
+    uint64_t source_mtime;
+    uint32_t legacy_us;     // SDL_GameControllerAddMappingsFromFile, timed at build
+    uint32_t strings_size;
+    char platform[16];
+} GcdbHeader;
+
+// count entries sorted by GUID, then named_count with no GUID, followed
+// by the mapping strings, each NUL terminated
+typedef struct GcdbEntry
+{
+    uint8_t guid[16];
+    uint32_t offset;
+    uint32_t length;
+} GcdbEntry;
+
+static const GcdbHeader *db;
+static const GcdbEntry *entries;
+static const GcdbEntry *named;
+static const char *strings;
+
+static HANDLE file = INVALID_HANDLE_VALUE;
+static HANDLE mapping;
+static void *built;     // the index, when it couldn't be written out
+
+static double ms_since(LARGE_INTEGER start)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (now.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart;
+}
+
+static int source_info(const char *path, uint64_t *size, uint64_t *mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &info)) {
+        return 0;
+    }
+    *size = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+    *mtime = (uint64_t)info.ftLastWriteTime.dwHighDateTime << 32
+           | info.ftLastWriteTime.dwLowDateTime;
+    return 1;
+}
+
+static int use_index(const void *data, uint64_t size, uint64_t src_size, uint64_t src_mtime)
+{
+    const GcdbHeader *h = data;
+    if (size < sizeof(*h)
+        || memcmp(h->magic, GCDB_MAGIC, sizeof(h->magic)) != 0
+        || h->version != GCDB_VERSION
+        || h->source_size != src_size
+        || h->source_mtime != src_mtime
+        || strncmp(h->platform, SDL_GetPlatform(), sizeof(h->platform)) != 0
+        || size != sizeof(*h) + ((uint64_t)h->count + h->named_count) * sizeof(GcdbEntry)
+                    + h->strings_size) {
+        return 0;
+    }
+
+    db = h;
+    entries = (const GcdbEntry *)(h + 1);
+    named = entries + h->count;
+    strings = (const char *)(named + h->named_count);
+    return 1;
+}
+
+static int map_index(const char *path, uint64_t src_size, uint64_t src_mtime)
+{
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (view != NULL && use_index(view, size.QuadPart, src_size, src_mtime)) {
+                return 1;
+            }
+            if (view != NULL) {
+                UnmapViewOfFile(view);
+            }
+        }
+    }
+
+    gcdb_close();
+    return 0;
+}
+
+typedef struct Line
+{
+    SDL_JoystickGUID guid;
+    const char *text;
+    uint32_t length;
+    uint32_t order;
+} Line;
+
+static int compare_lines(const void *a, const void *b)
+{
+    const Line *la = a, *lb = b;
+    int c = memcmp(&la->guid, &lb->guid, sizeof(la->guid));
+    if (c != 0) {
+        return c;
+    }
+    return la->order < lb->order ? -1 : la->order > lb->order;
+}
+
+/* parses the text file into an index image; returns its size, 0 on failure */
+static size_t build_index(const char *txt_path, void **out)
+{
+    FILE *f = fopen(txt_path, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *text = malloc(len + 1);
+    Line *lines = NULL;
+    size_t count = 0, capacity = 0;
+    Line *names = NULL;
+    size_t named_count = 0, named_capacity = 0;
+    size_t image_size = 0;
+    *out = NULL;
+
+    if (text == NULL || fread(text, 1, len, f) != (size_t)len) {
+        goto done;
+    }
+    text[len] = '\0';
+
+    const char *platform = SDL_GetPlatform();
+    size_t platform_len = strlen(platform);
+    size_t strings_size = 0;
+
+    for (char *line = text, *next; *line; line = next) {
+        char *end = strchr(line, '\n');
+        next = end ? end + 1 : line + strlen(line);
+        if (end == NULL) { end = next; }
+        *end = '\0';
+        if (end > line && end[-1] == '\r') { *--end = '\0'; }
+
+        // same rules as SDL_GameControllerAddMappingsFromRW: only lines
+        // for this platform
+        const char *p = strstr(line, "platform:");
+        if (line[0] == '#' || p == NULL || strncmp(p + 9, platform, platform_len) != 0
+            || (p[9 + platform_len] != ',' && p[9 + platform_len] != '\0')) {
+            continue;
+        }
+
+        // mappings named instead of keyed by a GUID, like SDL's "xinput"
+        // fallback, don't belong to one device; they're kept in file
+        // order and all registered at open
+        if (end - line < 33 || line[32] != ',') {
+            const char *comma = strchr(line, ',');
+            if (comma == NULL || comma == line) {
+                continue;
+            }
+            if (named_count == named_capacity) {
+                named_capacity = named_capacity ? named_capacity * 2 : 8;
+                Line *grown = realloc(names, named_capacity * sizeof(*names));
+                if (grown == NULL) { goto done; }
+                names = grown;
+            }
+            names[named_count] = (Line) { {{0}}, line, (uint32_t)(end - line), (uint32_t)named_count };
+            named_count++;
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Line *grown = realloc(lines, capacity * sizeof(*lines));
+            if (grown == NULL) { goto done; }
+            lines = grown;
+        }
+
+        char guidstr[33];
+        memcpy(guidstr, line, 32);
+        guidstr[32] = '\0';
+        lines[count] = (Line) {
+            SDL_JoystickGetGUIDFromString(guidstr), line, (uint32_t)(end - line), (uint32_t)count
+        };
+        count++;
+    }
+
+    // sort by GUID; of duplicates the last one wins, like in SDL
+    qsort(lines, count, sizeof(*lines), compare_lines);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (unique > 0 && memcmp(&lines[unique - 1].guid, &lines[i].guid, sizeof(SDL_JoystickGUID)) == 0) {
+            unique--;
+        }
+        lines[unique++] = lines[i];
+    }
+    for (size_t i = 0; i < unique; ++i) {
+        strings_size += lines[i].length + 1;
+    }
+    for (size_t i = 0; i < named_count; ++i) {
+        strings_size += names[i].length + 1;
+    }
+
+    image_size = sizeof(GcdbHeader) + (unique + named_count) * sizeof(GcdbEntry) + strings_size;
+    uint8_t *image = calloc(1, image_size);
+    if (image == NULL) {
+        image_size = 0;
+        goto done;
+    }
+
+    GcdbHeader *h = (GcdbHeader *)image;
+    memcpy(h->magic, GCDB_MAGIC, sizeof(h->magic));
+    h->version = GCDB_VERSION;
+    h->count = unique;
+    h->named_count = named_count;
+    h->strings_size = strings_size;
+    snprintf(h->platform, sizeof(h->platform), "%s", platform);
+
+    GcdbEntry *e = (GcdbEntry *)(h + 1);
+    char *s = (char *)(e + unique + named_count);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < unique + named_count; ++i) {
+        const Line *l = i < unique ? &lines[i] : &names[i - unique];
+        memcpy(e[i].guid, &l->guid, sizeof(e[i].guid));
+        e[i].offset = offset;
+        e[i].length = l->length;
+        memcpy(s + offset, l->text, l->length);
+        offset += l->length + 1;
+    }
+    *out = image;
+
+done:
+    free(names);
+    free(lines);
+    free(text);
+    fclose(f);
+    return image_size;
+}
+
+/* the named mappings apply to any device, so they're added right away */
+static void register_named(void)
+{
+    for (uint32_t i = 0; i < db->named_count; ++i) {
+        const GcdbEntry *e = &named[i];
+        if (e->offset + e->length < db->strings_size) {
+            SDL_GameControllerAddMapping(strings + e->offset);
+        }
+    }
+}
+
+int gcdb_open(const char *txt_path)
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    uint64_t src_size, src_mtime;
+    if (!source_info(txt_path, &src_size, &src_mtime)) {
+        return -1;
+    }
+
+    char idx_path[PATH_MAX];
+    snprintf(idx_path, sizeof(idx_path), "%s", txt_path);
+    PathRenameExtensionA(idx_path, ".idx");
+
+    if (map_index(idx_path, src_size, src_mtime)) {
+        dlog("    Mapped the gamecontrollerdb index: %u mappings in %.2f ms "
+             "(SDL_GameControllerAddMappingsFromFile took %.2f ms)",
+             db->count, ms_since(start), db->legacy_us / 1000.0);
+        register_named();
+        return db->count;
+    }
+
+    // time loading the whole file into SDL, which is what this replaces,
+    // once per index so later runs can log the comparison. it registers
+    // every mapping for this session, as before the index existed
+    int legacy_count = SDL_GameControllerAddMappingsFromFile(txt_path);
+    double legacy_ms = ms_since(start);
+    QueryPerformanceCounter(&start);
+
+    void *image;
+    size_t size = build_index(txt_path, &image);
+    if (size == 0) {
+        return -1;
+    }
+    GcdbHeader *h = image;
+    h->source_size = src_size;
+    h->source_mtime = src_mtime;
+    h->legacy_us = legacy_count >= 0 ? (uint32_t)(legacy_ms * 1000.0) : 0;
+
+    // write to a temporary file first, so a half written index never exists
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+    FILE *f = fopen(tmp_path, "wb");
+    int written = f != NULL && fwrite(image, 1, size, f) == size;
+    if (f != NULL && fclose(f) != 0) {
+        written = 0;
+    }
+    written = written && MoveFileExA(tmp_path, idx_path, MOVEFILE_REPLACE_EXISTING);
+    if (!written) {
+        DeleteFileA(tmp_path);
+    }
+
+    if (written && map_index(idx_path, src_size, src_mtime)) {
+        free(image);
+        dlog("    Built the gamecontrollerdb index: %u mappings in %.2f ms "
+             "(SDL_GameControllerAddMappingsFromFile took %.2f ms)",
+             db->count, ms_since(start), legacy_ms);
+        register_named();
+        return db->count;
+    }
+
+    // keep using it from memory
+    use_index(image, size, src_size, src_mtime);
+    built = image;
+    dlog("    Unable to write %s, using the gamecontrollerdb index from memory", idx_path);
+    register_named();
+    return db->count;
+}
+
+void gcdb_close(void)
+{
+    if (db != NULL && built == NULL) {
+        UnmapViewOfFile(db);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    free(built);
+    built = NULL;
+    db = NULL;
+    entries = NULL;
+    named = NULL;
+    strings = NULL;
+}
+
+static const GcdbEntry *find(const uint8_t guid[16])
+{
+    size_t lo = 0, hi = db->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(entries[mid].guid, guid, 16);
+        if (c == 0) {
+            return &entries[mid];
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+int gcdb_register_device(int device_index)
+{
+    // SDL already has a mapping for it; adding it again would only send a
+    // remapped event to open controllers of the same kind
+    if (db == NULL || SDL_IsGameController(device_index)) {
+        return 0;
+    }
+
+    SDL_JoystickGUID guid = SDL_JoystickGetDeviceGUID(device_index);
+    uint8_t key[16];
+    memcpy(key, guid.data, sizeof(key));
+
+    // newer SDL puts a name CRC and a version into GUIDs, while most
+    // database entries have them zeroed; try those the way SDL does
+    const GcdbEntry *e = find(key);
+    if (e == NULL) {
+        key[2] = key[3] = 0;
+        e = find(key);
+    }
+    if (e == NULL) {
+        key[12] = key[13] = 0;
+        e = find(key);
+    }
+    if (e == NULL || e->offset + e->length >= db->strings_size) {
+        return 0;
+    }
+
+    return SDL_GameControllerAddMapping(strings + e->offset) >= 0;
+}
@@ -0,0 +1,19 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_GCDB_H_
+#define OCTOMINO_GCDB_H_
+
+/* Binary index of gamecontrollerdb.txt. On first use (or when the text
+   file's size or modification time changed) the mappings for the current
+   platform are written next to it as gamecontrollerdb.idx, sorted by
+   GUID. Later runs only map that file, and mappings are handed to SDL
+   one device at a time as joysticks show up, unless SDL has one already. Mappings keyed by a name
+   rather than a GUID (SDL's "xinput" one) are registered at open. */
+
+int gcdb_open(const char *txt_path);
+void gcdb_close(void);
+int gcdb_register_device(int device_index);
+
+#endif
@@ -2,6 +2,8 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include "gui_renderer.h"
@@ -9,26 +11,56 @@
 #include "gui.h"
 #include "sdl_input.h"
 #include "config.h"
+#include "sampler.h"
+#include "stats.h"
+#include "events.h"
+#include "epoch.h"
+
+#define LOG_LINES    256
+#define LOG_LINE_LEN 256
+
+/* log lines in a ring, oldest first from log_head; written by the log
+   writer thread, read by the GUI thread */
+static char log_lines[LOG_LINES][LOG_LINE_LEN];
+static unsigned int log_head = 0;
+static unsigned int log_count = 0;
+static unsigned int log_total = 0;  // lines ever written
+static SRWLOCK log_lock = SRWLOCK_INIT;
+
+/* GUI thread only: lines are copied out of the ring, so the writer is
+   only held up for the copy, and measured here */
+#define LOG_SHOWN_MAX 64
+static char log_new[LOG_LINES][LOG_LINE_LEN];
+static char log_shown[LOG_SHOWN_MAX][LOG_LINE_LEN];
+static unsigned int log_seen = 0;
+static int log_width = 0;
+static float bg[3] = { 90, 95, 100 };
 
-#define LOG_SIZE 64000
+static ControllerConfig concfg_last[PORT_COUNT];
+static PluginConfig plugcfg_last;
 
-static  char logbuf[LOG_SIZE];
-static   int logbuf_updated = 0;
-static float bg[3] = { 90, 95, 100 };
+/* with nothing to react to, wake up this often to refresh live data */
+#define GUI_IDLE_MS 100
 
 static int window_open = 0;
 static mu_Context *context;
 static char not_available[] = "N/A";
 
 void write_log(char *text) {
-    if (logbuf[0]) { strcat(logbuf, "\n"); }
-
-    if ((strlen(logbuf) + strlen(text) + 1) >= LOG_SIZE) {
-        memcpy(logbuf, logbuf+LOG_SIZE/2, LOG_SIZE/2);
+    AcquireSRWLockExclusive(&log_lock);
+
+    char *line = log_lines[(log_head + log_count) % LOG_LINES];
+    if (log_count == LOG_LINES) {
+        /* full, the new line takes the oldest one's slot */
+        log_head = (log_head + 1) % LOG_LINES;
+    } else {
+        log_count++;
     }
 
-    strcat(logbuf, text);
-    logbuf_updated = 1;
+    snprintf(line, LOG_LINE_LEN, "%s", text);
+    log_total++;
+
+    ReleaseSRWLockExclusive(&log_lock);
 }
 
 static int uint_slider(mu_Context *ctx, unsigned int *value, int low, int high) {
@@ -81,42 +113,126 @@ static void log_panel(mu_Context *ctx) {
         mu_layout_row(ctx, 1, (int[]) { -1 }, 300);
         mu_begin_panel(ctx, "Log Output");
         mu_Container *panel = mu_get_current_container(ctx);
-        mu_layout_row(ctx, 1, (int[]) { -1 }, -1);
-        mu_text(ctx, logbuf);
-        if (logbuf_updated) {
-            panel->scroll.y = panel->content_size.y;
-            logbuf_updated = 0;
+
+        /* one row per line; only the rows inside the viewport get any
+           content, the rest is covered by two spacers */
+        int line_h = ctx->text_height(ctx->style->font);
+        int row_h = line_h + ctx->style->spacing;
+
+        /* copy out the lines added since the last frame, and the
+           visible ones */
+        AcquireSRWLockExclusive(&log_lock);
+        int count = (int)log_count;
+        int added = (int)mu_min(log_total - log_seen, log_count);
+        for (int i = 0; i < added; ++i) {
+            memcpy(log_new[i], log_lines[(log_head + count - added + i) % LOG_LINES], LOG_LINE_LEN);
+        }
+        int updated = log_total != log_seen;
+        log_seen = log_total;
+
+        int first = mu_clamp(panel->scroll.y / row_h, 0, count);
+        int last = mu_clamp(first + mu_min(panel->body.h / row_h + 2, LOG_SHOWN_MAX), 0, count);
+        for (int i = first; i < last; ++i) {
+            memcpy(log_shown[i - first], log_lines[(log_head + i) % LOG_LINES], LOG_LINE_LEN);
+        }
+        ReleaseSRWLockExclusive(&log_lock);
+
+        for (int i = 0; i < added; ++i) {
+            log_width = mu_max(log_width, r_get_text_width(log_new[i], -1));
+        }
+        int width = log_width + ctx->style->padding * 2;
+        if (width < panel->body.w) { width = -1; }
+
+        if (first > 0) {
+            mu_layout_row(ctx, 1, &width, first * row_h - ctx->style->spacing);
+            mu_layout_next(ctx);
+        }
+        mu_layout_row(ctx, 1, &width, line_h);
+        for (int i = first; i < last; ++i) {
+            mu_label(ctx, log_shown[i - first]);
+        }
+        if (last < count) {
+            mu_layout_row(ctx, 1, &width, (count - last) * row_h - ctx->style->spacing);
+            mu_layout_next(ctx);
+        }
+
+        if (updated) {
+            panel->scroll.y = count * row_h;
         }
+
         mu_end_panel(ctx);
     }
 }
 
+static void coninfo_device(mu_Context *ctx, int port, int dev, DeviceInfo *info, int rank, int bound)
+{
+    char buf[64];
+    int id = port * 16 + dev;
+    mu_push_id(ctx, &id, sizeof(id));
+
+    mu_label(ctx,"GUID");
+    mu_label(ctx, info->guid_str);
+
+    mu_label(ctx,"GameController mapping");
+    mu_label(ctx, info->mapping);
+
+    mu_label(ctx, "Preference");
+    if (rank > 0) {
+        snprintf(buf, sizeof(buf), "#%d of %d, prefer this one", rank + 1, devices_count());
+        if (mu_button(ctx, buf)) {
+            con_prefer(port, dev);
+        }
+    } else {
+        mu_label(ctx, "Preferred controller");
+    }
+
+    // cycles through any port, then ports 1 to 4
+    mu_label(ctx, "Bound to");
+    if (bound == -1) {
+        snprintf(buf, sizeof(buf), "Any port");
+    } else {
+        snprintf(buf, sizeof(buf), "Port %d", bound + 1);
+    }
+    if (mu_button(ctx, buf)) {
+        con_bind(port, dev, bound + 1 < PORT_COUNT ? bound + 1 : -1);
+    }
+
+    mu_pop_id(ctx);
+}
+
+static void coninfo_port(mu_Context *ctx, int port)
+{
+    // copied from what was cached at open
+    static DeviceInfo info;
+    int rank = -1;
+    int bound = -1;
+
+    char title[32];
+    snprintf(title, sizeof(title), "Controller %d", port + 1);
+
+    int dev = 0;
+    for (; con_get_info(port, dev, &info, &rank, &bound); ++dev) {
+        mu_label(ctx, dev == 0 ? title : "...merged with");
+        mu_label(ctx, info.name);
+        coninfo_device(ctx, port, dev, &info, rank, bound);
+    }
+
+    if (dev == 0) {
+        mu_label(ctx, title);
+        mu_label(ctx, not_available);
+    }
+}
+
 static void coninfo_panel(mu_Context *ctx)
 {
     if (mu_header_ex(ctx, "Controller info", MU_OPT_EXPANDED)) {
         const int widths[] = {150, -1};
         mu_layout_row(ctx, 2, widths, 0);
 
-        
-        mu_label(ctx,"Name");
-        if (con != NULL) {
-            const char *name = SDL_GameControllerName(con);
-            if (name != NULL) {
-                mu_label(ctx, name);
-            } 
-        } else {
-            mu_label(ctx, not_available);
-        }
-
-        mu_label(ctx,"GameController mapping");
-        if (con != NULL) {
-            char *mapping = SDL_GameControllerMapping(con);
-            if (mapping != NULL) {
-                mu_label(ctx, mapping);
-                SDL_free(mapping);
-            } 
-        } else {
-            mu_label(ctx, not_available);
+        for (int port = 0; port < PORT_COUNT; ++port) {
+            if (concfg[port].plugged) {
+                coninfo_port(ctx, port);
+            }
         }
     }
 }
@@ -147,6 +263,13 @@ static void analog_panel(mu_Context *ctx, ControllerConfig *cfg)
         int *clamp = &cfg->is_clamped;
         mu_checkbox(ctx, "", clamp);
 
+        // octagonal gate notches, used when clamping
+        mu_label(ctx, "Gate cardinal notch");
+        uint_slider(ctx, &cfg->gate_cardinal, 1, 127);
+
+        mu_label(ctx, "Gate diagonal notch");
+        uint_slider(ctx, &cfg->gate_diagonal, 1, 127);
+
         mu_end_treenode(ctx);
     }
 }
@@ -236,6 +359,34 @@ static void binding_panel(mu_Context *ctx, ControllerConfig *cfg)
     }
 }
 
+static void latch_panel(mu_Context *ctx, ControllerConfig *cfg)
+{
+    if (mu_begin_treenode(ctx, "Press latching")) {
+        const int widths[] = {150, -1};
+        mu_layout_row(ctx, 2, widths, 0);
+
+        mu_label(ctx, "Latch short presses");
+        mu_checkbox(ctx, "", &cfg->latching);
+
+        // minimum frames each press is reported for, 0 = not latched
+        for (int i = 0; i < CONTROLLER_BUTTON_COUNT; ++i) {
+            mu_label(ctx, get_con_buttonaxis_name(CONTROLLER_A + i));
+            uint_slider(ctx, &cfg->latch_frames[i], 0, 10);
+        }
+
+        unsigned int presses, saved;
+        uint32_t shortest_tap;
+        con_latch_stats(&presses, &saved, &shortest_tap);
+
+        char buf[64];
+        mu_label(ctx, "Presses saved");
+        snprintf(buf, sizeof(buf), "%u of %u (shortest %u ms)", saved, presses, shortest_tap);
+        mu_label(ctx, buf);
+
+        mu_end_treenode(ctx);
+    }
+}
+
 static void a2d_panel(mu_Context *ctx, ControllerConfig *cfg)
 {
     if (mu_begin_treenode_ex(ctx, "Analog to digital mapping", MU_OPT_EXPANDED)) {
@@ -257,9 +408,104 @@ static void a2d_panel(mu_Context *ctx, ControllerConfig *cfg)
 static void controller_panel(mu_Context *ctx, ControllerConfig *cfg, const char name[], int opt)
 {
     if (mu_header_ex(ctx, name, opt)) {
+        const int widths[] = {150, -1};
+        mu_layout_row(ctx, 2, widths, 0);
+        mu_label(ctx, "Plugged in (on restart)");
+        mu_checkbox(ctx, "", &cfg->plugged);
+
+        // the tree nodes below are named the same for every port
+        mu_push_id(ctx, &cfg, sizeof(cfg));
         binding_panel(ctx, cfg);
         a2d_panel(ctx, cfg);
         analog_panel(ctx, cfg);
+        latch_panel(ctx, cfg);
+        mu_pop_id(ctx);
+    }
+}
+
+static void plugin_panel(mu_Context *ctx, PluginConfig *cfg)
+{
+    if (mu_header(ctx, "Plugin settings")) {
+        const int widths[] = {150, -1};
+        mu_layout_row(ctx, 2, widths, 0);
+
+        // 0 disables the background sampler thread
+        mu_label(ctx, "Sampler rate (Hz)");
+        uint_slider(ctx, &cfg->sampler_rate, 0, SAMPLER_RATE_MAX);
+
+        mu_label(ctx, "Just-in-time polling");
+        mu_checkbox(ctx, "Sample right before GetKeys", &cfg->jit_polling);
+
+        mu_label(ctx, "JIT margin (us)");
+        uint_slider(ctx, &cfg->jit_margin_us, 0, 4000);
+
+        SamplerTiming t;
+        sampler_get_timing(&t);
+        char buf[64];
+        mu_label(ctx, "GetKeys period");
+        if (t.locked) {
+            snprintf(buf, sizeof(buf), "%.3f ms (jitter %.3f ms)", t.period_ms, t.jitter_ms);
+        } else {
+            snprintf(buf, sizeof(buf), "not locked");
+        }
+        mu_label(ctx, buf);
+        mu_label(ctx, "Sample age at read");
+        snprintf(buf, sizeof(buf), "%.3f ms", t.age_ms);
+        mu_label(ctx, buf);
+
+        mu_label(ctx, "Event-driven inputs");
+        mu_checkbox(ctx, "Track inputs from SDL events", &cfg->event_inputs);
+
+        mu_label(ctx, "Reference mapping");
+        mu_checkbox(ctx, "Use the uncompiled mapping path", &cfg->reference_mapping);
+
+        mu_label(ctx, "Verify mapping");
+        mu_checkbox(ctx, "Log compiled/reference mismatches", &cfg->verify_mapping);
+
+        mu_label(ctx, "Fixed-point analog");
+        mu_checkbox(ctx, "Integer stick pipeline (off: float)", &cfg->fixed_analog);
+
+        // 0 disables the cap
+        mu_label(ctx, "Config window FPS cap");
+        uint_slider(ctx, &cfg->gui_fps, 0, 240);
+    }
+}
+
+static void performance_panel(mu_Context *ctx)
+{
+    if (mu_header(ctx, "Performance")) {
+        const int widths[] = {150, -1};
+        mu_layout_row(ctx, 2, widths, 0);
+
+        char buf[128];
+        for (int i = 0; i < STAT_COUNT; ++i) {
+            mu_label(ctx, stats_name(i));
+            stats_format(i, buf, sizeof(buf));
+            mu_label(ctx, buf);
+        }
+        mu_label(ctx, "Mapping cache");
+        stats_cache_format(buf, sizeof(buf));
+        mu_label(ctx, buf);
+
+        /* counts are for the last frame drawn */
+        RendererStats r;
+        r_get_stats(&r);
+        mu_label(ctx, "Config window");
+        snprintf(buf, sizeof(buf), "%d quads (%d culled, %d trimmed), %d uploads",
+            r.quads, r.culled, r.trimmed, r.uploads);
+        mu_label(ctx, buf);
+        mu_label(ctx, "");
+        snprintf(buf, sizeof(buf), "%d draw calls (%d with scissor clipping)",
+            r.draw_calls, r.clip_batches);
+        mu_label(ctx, buf);
+        mu_label(ctx, "");
+        snprintf(buf, sizeof(buf), "%u of %u frames reused buffers", r.skipped_uploads, r.frames);
+        mu_label(ctx, buf);
+
+        mu_label(ctx, "");
+        if (mu_button(ctx, "Reset")) {
+            stats_reset();
+        }
     }
 }
 
@@ -292,7 +538,13 @@ static void test_window(mu_Context *ctx) {
     int opt = MU_OPT_NOINTERACT | MU_OPT_NOTITLE;
     if (mu_begin_window_ex(ctx, "Demo Window", mu_rect(0, 0, 600, 600), opt)) {
         coninfo_panel(ctx);
-        controller_panel(ctx, &concfg, "Controller 1 settings", MU_OPT_EXPANDED);
+        for (int port = 0; port < PORT_COUNT; ++port) {
+            char name[32];
+            snprintf(name, sizeof(name), "Controller %d settings", port + 1);
+            controller_panel(ctx, &concfg[port], name, port == 0 ? MU_OPT_EXPANDED : 0);
+        }
+        plugin_panel(ctx, &plugcfg);
+        performance_panel(ctx);
         configfile_panel(ctx);
         log_panel(ctx);
 
@@ -338,6 +590,54 @@ static int text_height(mu_Font font) {
 }
 
 
+/* FNV-1a over the frame's draw commands */
+static uint64_t command_hash(mu_Context *ctx) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (int i = 0; i < ctx->command_list.idx; ++i) {
+        h = (h ^ (unsigned char)ctx->command_list.items[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+/* CPU time of the calling thread in 100 ns units */
+static uint64_t thread_cpu_time(void) {
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    return ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+         + ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+}
+
+/* feeds an event to microui, returns 1 if the window has to be repainted */
+static int handle_event(SDL_Event *e) {
+    switch (e->type) {
+        case SDL_QUIT: gui_deinit(); break;
+        case SDL_WINDOWEVENT: return 1;
+        case SDL_MOUSEMOTION: mu_input_mousemove(context, e->motion.x, e->motion.y); break;
+        case SDL_MOUSEWHEEL: mu_input_scroll(context, 0, e->wheel.y * -30); break;
+        case SDL_TEXTINPUT: mu_input_text(context, e->text.text); break;
+
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP: {
+            int b = button_map[e->button.button & 0xff];
+            if (b && e->type == SDL_MOUSEBUTTONDOWN) { mu_input_mousedown(context, e->button.x, e->button.y, b); }
+            if (b && e->type ==   SDL_MOUSEBUTTONUP) { mu_input_mouseup(context, e->button.x, e->button.y, b);   }
+            break;
+        }
+
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            int c = key_map[e->key.keysym.sym & 0xff];
+            if (c && e->type == SDL_KEYDOWN) { mu_input_keydown(context, c); }
+            if (c && e->type ==   SDL_KEYUP) { mu_input_keyup(context, c);   }
+            break;
+        }
+    }
+    return 0;
+}
+
+
 void config_window() {
     EnterCriticalSection(&critical_section);
 
@@ -361,57 +661,107 @@ void config_window() {
     context->text_width = text_width;
     context->text_height = text_height;
 
+    memcpy(concfg_last, concfg, sizeof(concfg_last));
+    plugcfg_last = plugcfg;
+    events_subscribe(EVENTS_GUI, 1);
+
     /* main loop */
+    uint64_t last_hash = 0;
+    int redraw = 1;     /* the window needs repainting whatever the contents */
+    int settling = 1;   /* the last frame changed, run the next one right away */
+    uint32_t last_present = 0;
+    unsigned int frames = 0, drawn = 0;
+    uint64_t render_cpu = 0;
+    uint64_t cpu_start = thread_cpu_time();
+    uint32_t wall_start = SDL_GetTicks();
+
     while (window_open) {
         LeaveCriticalSection(&critical_section);
-        /* handle SDL events */
+        /* handle SDL events, blocking until there are some when idle;
+           controller events go to the input path's own queue */
         SDL_Event e;
-        while (SDL_PollEvent(&e)) {
-            switch (e.type) {
-                case SDL_QUIT: gui_deinit(); break;
-                case SDL_MOUSEMOTION: mu_input_mousemove(context, e.motion.x, e.motion.y); break;
-                case SDL_MOUSEWHEEL: mu_input_scroll(context, 0, e.wheel.y * -30); break;
-                case SDL_TEXTINPUT: mu_input_text(context, e.text.text); break;
-
-                case SDL_MOUSEBUTTONDOWN:
-                case SDL_MOUSEBUTTONUP: {
-                    int b = button_map[e.button.button & 0xff];
-                    if (b && e.type == SDL_MOUSEBUTTONDOWN) { mu_input_mousedown(context, e.button.x, e.button.y, b); }
-                    if (b && e.type ==   SDL_MOUSEBUTTONUP) { mu_input_mouseup(context, e.button.x, e.button.y, b);   }
-                    break;
-                }
-
-                case SDL_KEYDOWN:
-                case SDL_KEYUP: {
-                    int c = key_map[e.key.keysym.sym & 0xff];
-                    if (c && e.type == SDL_KEYDOWN) { mu_input_keydown(context, c); }
-                    if (c && e.type ==   SDL_KEYUP) { mu_input_keyup(context, c);   }
-                    break;
-                }
-            }
+        if (!settling && !redraw) {
+            events_wait(EVENTS_GUI, GUI_IDLE_MS);
+        } else {
+            events_pump();
+        }
+        while (events_next(EVENTS_GUI, &e)) {
+            redraw |= handle_event(&e);
         }
 
-        /* process frame */
-        EnterCriticalSection(&critical_section);
+        /* process frame. the widgets edit concfg and plugcfg, which only
+           this thread touches; GetKeys keeps using the last published
+           snapshot, so no lock is needed */
         process_frame(context);
-        LeaveCriticalSection(&critical_section);
+        if (memcmp(&concfg, &concfg_last, sizeof(concfg)) != 0
+            || memcmp(&plugcfg, &plugcfg_last, sizeof(plugcfg)) != 0) {
+            /* publish any edit made this frame */
+            memcpy(concfg_last, concfg, sizeof(concfg_last));
+            plugcfg_last = plugcfg;
+            config_changed();
+        }
+        unsigned int fps = plugcfg.gui_fps;
+        sampler_set_jit(plugcfg.jit_polling, plugcfg.jit_margin_us);
+        sampler_set_rate(plugcfg.sampler_rate);
+
+        /* skip drawing when the frame looks exactly like the last one */
+        ++frames;
+        uint64_t hash = command_hash(context);
+        settling = hash != last_hash;
+        if (settling || redraw) {
+            last_hash = hash;
+            redraw = 0;
+
+            /* frame cap */
+            uint32_t since = SDL_GetTicks() - last_present;
+            if (fps > 0 && since < 1000 / fps) {
+                SDL_Delay(1000 / fps - since);
+            }
 
-        /* render */
-        r_clear(mu_color(bg[0], bg[1], bg[2], 255));
-        mu_Command *cmd = NULL;
-        while (mu_next_command(context, &cmd)) {
-            switch (cmd->type) {
-                case MU_COMMAND_TEXT: r_draw_text(cmd->text.str, cmd->text.pos, cmd->text.color); break;
-                case MU_COMMAND_RECT: r_draw_rect(cmd->rect.rect, cmd->rect.color); break;
-                case MU_COMMAND_ICON: r_draw_icon(cmd->icon.id, cmd->icon.rect, cmd->icon.color); break;
-                case MU_COMMAND_CLIP: r_set_clip_rect(cmd->clip.rect); break;
+            /* render */
+            uint64_t render_start = thread_cpu_time();
+            if (r_begin_frame(hash)) {
+                r_clear(mu_color(bg[0], bg[1], bg[2], 255));
+                mu_Command *cmd = NULL;
+                while (mu_next_command(context, &cmd)) {
+                    switch (cmd->type) {
+                        case MU_COMMAND_TEXT: r_draw_text(cmd->text.str, cmd->text.pos, cmd->text.color); break;
+                        case MU_COMMAND_RECT: r_draw_rect(cmd->rect.rect, cmd->rect.color); break;
+                        case MU_COMMAND_ICON: r_draw_icon(cmd->icon.id, cmd->icon.rect, cmd->icon.color); break;
+                        case MU_COMMAND_CLIP: r_set_clip_rect(cmd->clip.rect); break;
+                    }
+                }
             }
+            r_present();
+            render_cpu += thread_cpu_time() - render_start;
+            last_present = SDL_GetTicks();
+            ++drawn;
         }
-        r_present();
 
         EnterCriticalSection(&critical_section);
     }
 
+    /* the old loop rendered every frame; what that would have cost is
+       estimated from the CPU time the frames drawn here took */
+    double seconds = (SDL_GetTicks() - wall_start) / 1000.0;
+    double cpu_ms = (thread_cpu_time() - cpu_start) / 10000.0;
+    double frame_cpu_ms = drawn ? render_cpu / 10000.0 / drawn : 0;
+    dlog("Config window open for %.1f s: drew %u of %u frames, %.0f ms CPU "
+         "(%.1f%% of a core); rendering took %.2f ms CPU per frame, so skipping "
+         "unchanged frames saved about %.0f ms CPU",
+         seconds, drawn, frames, cpu_ms, seconds > 0 ? cpu_ms / (seconds * 10) : 0,
+         frame_cpu_ms, (frames - drawn) * frame_cpu_ms);
+
+    RendererStats r;
+    r_get_stats(&r);
+    if (r.total_clip_batches > 0) {
+        dlog("Config window made %u draw calls, %u with scissor clipping (%.0f%% fewer)",
+             r.total_draw_calls, r.total_clip_batches,
+             100.0 - 100.0 * r.total_draw_calls / r.total_clip_batches);
+    }
+
+    events_subscribe(EVENTS_GUI, 0);
+    epoch_reclaim();
     free(context);
     r_close();
 
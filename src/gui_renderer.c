@@ -15,12 +15,82 @@ static GLfloat  vert_buf[BUFFER_SIZE *  8];
 static GLubyte color_buf[BUFFER_SIZE * 16];
 static GLuint  index_buf[BUFFER_SIZE *  6];
 
+/* quads are clipped on the CPU, so a frame needs no scissor changes and
+   goes out in a single draw call */
+static mu_Rect clip_rect;
+static int clip_used;
+
 static int width  = 600;
 static int height = 600;
 static int buf_idx;
 
+static mu_Color clear_color;
+static int cleared;
+
+/* the vertex buffer holds the frame with this key, 0 if none */
+static uint64_t retained_key;
+static uint64_t frame_key;
+static int replaying;
+
+static RendererStats stats;
+
 static SDL_Window *window;
 
+static PFNGLGENBUFFERSPROC    gl_gen_buffers;
+static PFNGLBINDBUFFERPROC    gl_bind_buffer;
+static PFNGLBUFFERDATAPROC    gl_buffer_data;
+static PFNGLBUFFERSUBDATAPROC gl_buffer_sub_data;
+static PFNGLDELETEBUFFERSPROC gl_delete_buffers;
+static GLuint vbo, ibo;
+
+#define VERT_OFFSET  0
+#define TEX_OFFSET   (sizeof(vert_buf))
+#define COLOR_OFFSET (sizeof(vert_buf) + sizeof(tex_buf))
+
+
+/* ISO C has no cast from void * to a function pointer */
+static void load_proc(void *fn, const char *name) {
+    void *proc = SDL_GL_GetProcAddress(name);
+    memcpy(fn, &proc, sizeof(proc));
+}
+
+
+static void init_buffers(void) {
+    /* the index pattern is the same for every quad, build it once */
+    for (int i = 0; i < BUFFER_SIZE; i++) {
+        index_buf[i * 6 + 0] = i * 4 + 0;
+        index_buf[i * 6 + 1] = i * 4 + 1;
+        index_buf[i * 6 + 2] = i * 4 + 2;
+        index_buf[i * 6 + 3] = i * 4 + 2;
+        index_buf[i * 6 + 4] = i * 4 + 3;
+        index_buf[i * 6 + 5] = i * 4 + 1;
+    }
+
+    /* buffer objects are GL 1.5, fall back to client arrays without them */
+    load_proc(&gl_gen_buffers,     "glGenBuffers");
+    load_proc(&gl_bind_buffer,     "glBindBuffer");
+    load_proc(&gl_buffer_data,     "glBufferData");
+    load_proc(&gl_buffer_sub_data, "glBufferSubData");
+    load_proc(&gl_delete_buffers,  "glDeleteBuffers");
+    if (!gl_gen_buffers || !gl_bind_buffer || !gl_buffer_data
+        || !gl_buffer_sub_data || !gl_delete_buffers) {
+        gl_gen_buffers = NULL;
+        return;
+    }
+
+    gl_gen_buffers(1, &vbo);
+    gl_bind_buffer(GL_ARRAY_BUFFER, vbo);
+    gl_buffer_data(GL_ARRAY_BUFFER, COLOR_OFFSET + sizeof(color_buf), NULL, GL_DYNAMIC_DRAW);
+
+    gl_gen_buffers(1, &ibo);
+    gl_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    gl_buffer_data(GL_ELEMENT_ARRAY_BUFFER, sizeof(index_buf), index_buf, GL_STATIC_DRAW);
+
+    glVertexPointer(2, GL_FLOAT, 0, (void *) VERT_OFFSET);
+    glTexCoordPointer(2, GL_FLOAT, 0, (void *) TEX_OFFSET);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, (void *) COLOR_OFFSET);
+}
+
 
 void r_init(void) {
     /* init SDL window */
@@ -34,7 +104,6 @@ void r_init(void) {
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glDisable(GL_CULL_FACE);
     glDisable(GL_DEPTH_TEST);
-    glEnable(GL_SCISSOR_TEST);
     glEnable(GL_TEXTURE_2D);
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -48,13 +117,29 @@ void r_init(void) {
         GL_ALPHA, GL_UNSIGNED_BYTE, atlas_texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    init_buffers();
+    retained_key = 0;
+    memset(&stats, 0, sizeof(stats));
     assert(glGetError() == 0);
 }
 
 
-static void flush(void) {
-    if (buf_idx == 0) { return; }
+static void upload(void) {
+    if (gl_gen_buffers) {
+        gl_buffer_sub_data(GL_ARRAY_BUFFER, VERT_OFFSET, buf_idx * 8 * sizeof(GLfloat), vert_buf);
+        gl_buffer_sub_data(GL_ARRAY_BUFFER, TEX_OFFSET, buf_idx * 8 * sizeof(GLfloat), tex_buf);
+        gl_buffer_sub_data(GL_ARRAY_BUFFER, COLOR_OFFSET, buf_idx * 16, color_buf);
+    } else {
+        glTexCoordPointer(2, GL_FLOAT, 0, tex_buf);
+        glVertexPointer(2, GL_FLOAT, 0, vert_buf);
+        glColorPointer(4, GL_UNSIGNED_BYTE, 0, color_buf);
+    }
+    stats.uploads++;
+}
 
+
+static void draw(void) {
     glViewport(0, 0, width, height);
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
@@ -64,34 +149,83 @@ static void flush(void) {
     glPushMatrix();
     glLoadIdentity();
 
-    glTexCoordPointer(2, GL_FLOAT, 0, tex_buf);
-    glVertexPointer(2, GL_FLOAT, 0, vert_buf);
-    glColorPointer(4, GL_UNSIGNED_BYTE, 0, color_buf);
-    glDrawElements(GL_TRIANGLES, buf_idx * 6, GL_UNSIGNED_INT, index_buf);
+    if (!cleared) {
+        mu_Color clr = clear_color;
+        glClearColor(clr.r / 255., clr.g / 255., clr.b / 255., clr.a / 255.);
+        glClear(GL_COLOR_BUFFER_BIT);
+        cleared = 1;
+    }
+
+    if (buf_idx > 0) {
+        if (gl_gen_buffers) {
+            glDrawElements(GL_TRIANGLES, buf_idx * 6, GL_UNSIGNED_INT, 0);
+        } else {
+            glDrawElements(GL_TRIANGLES, buf_idx * 6, GL_UNSIGNED_INT, index_buf);
+        }
+        stats.draw_calls++;
+        stats.total_draw_calls++;
+    }
 
     glMatrixMode(GL_MODELVIEW);
     glPopMatrix();
     glMatrixMode(GL_PROJECTION);
     glPopMatrix();
+}
+
 
+static void flush(void) {
+    /* out of room mid-frame: draw what's there and start over, the frame
+       can't be kept for replaying */
+    upload();
+    draw();
+    stats.quads += buf_idx;
     buf_idx = 0;
+    frame_key = 0;
 }
 
 
 static void push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
+    /* clip against the current clip rect, trimming the texture
+       coordinates along with the quad */
+    int x0 = mu_max(dst.x, clip_rect.x);
+    int y0 = mu_max(dst.y, clip_rect.y);
+    int x1 = mu_min(dst.x + dst.w, clip_rect.x + clip_rect.w);
+    int y1 = mu_min(dst.y + dst.h, clip_rect.y + clip_rect.h);
+    if (x0 >= x1 || y0 >= y1) {
+        stats.culled++;
+        return;
+    }
+
+    float u = src.x, v = src.y, uw = src.w, vh = src.h;
+    if (x0 != dst.x || y0 != dst.y || x1 != dst.x + dst.w || y1 != dst.y + dst.h) {
+        float sx = src.w / (float) dst.w;
+        float sy = src.h / (float) dst.h;
+        u  = src.x + (x0 - dst.x) * sx;
+        v  = src.y + (y0 - dst.y) * sy;
+        uw = (x1 - x0) * sx;
+        vh = (y1 - y0) * sy;
+        dst = mu_rect(x0, y0, x1 - x0, y1 - y0);
+        stats.trimmed++;
+    }
+
     if (buf_idx == BUFFER_SIZE) { flush(); }
 
     int texvert_idx = buf_idx *  8;
     int   color_idx = buf_idx * 16;
-    int element_idx = buf_idx *  4;
-    int   index_idx = buf_idx *  6;
     buf_idx++;
 
+    /* the old renderer issued a draw call per clip rect that had quads */
+    if (!clip_used) {
+        clip_used = 1;
+        stats.clip_batches++;
+        stats.total_clip_batches++;
+    }
+
     /* update texture buffer */
-    float x = src.x / (float) ATLAS_WIDTH;
-    float y = src.y / (float) ATLAS_HEIGHT;
-    float w = src.w / (float) ATLAS_WIDTH;
-    float h = src.h / (float) ATLAS_HEIGHT;
+    float x = u / ATLAS_WIDTH;
+    float y = v / ATLAS_HEIGHT;
+    float w = uw / ATLAS_WIDTH;
+    float h = vh / ATLAS_HEIGHT;
     tex_buf[texvert_idx + 0] = x;
     tex_buf[texvert_idx + 1] = y;
     tex_buf[texvert_idx + 2] = x + w;
@@ -116,14 +250,6 @@ static void push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
     memcpy(color_buf + color_idx +  4, &color, 4);
     memcpy(color_buf + color_idx +  8, &color, 4);
     memcpy(color_buf + color_idx + 12, &color, 4);
-
-    /* update index buffer */
-    index_buf[index_idx + 0] = element_idx + 0;
-    index_buf[index_idx + 1] = element_idx + 1;
-    index_buf[index_idx + 2] = element_idx + 2;
-    index_buf[index_idx + 3] = element_idx + 2;
-    index_buf[index_idx + 4] = element_idx + 3;
-    index_buf[index_idx + 5] = element_idx + 1;
 }
 
 
@@ -171,23 +297,62 @@ int r_get_text_height(void) {
 
 
 void r_set_clip_rect(mu_Rect rect) {
-    flush();
-    glScissor(rect.x, height - (rect.y + rect.h), rect.w, rect.h);
+    clip_rect = rect;
+    clip_used = 0;
+}
+
+
+int r_begin_frame(uint64_t key) {
+    stats.uploads = 0;
+    stats.draw_calls = 0;
+    cleared = 0;
+
+    frame_key = key;
+    replaying = key != 0 && key == retained_key;
+    if (replaying) {
+        /* quad counts still describe the retained frame */
+        stats.total_clip_batches += stats.clip_batches;
+        return 0;
+    }
+
+    stats.quads = 0;
+    stats.culled = 0;
+    stats.trimmed = 0;
+    stats.clip_batches = 0;
+    buf_idx = 0;
+    r_set_clip_rect(mu_rect(0, 0, width, height));
+    return 1;
 }
 
 
 void r_clear(mu_Color clr) {
-    flush();
-    glClearColor(clr.r / 255., clr.g / 255., clr.b / 255., clr.a / 255.);
-    glClear(GL_COLOR_BUFFER_BIT);
+    clear_color = clr;
+    cleared = 0;
 }
 
 
 void r_present(void) {
-    flush();
+    if (!replaying) {
+        upload();
+        retained_key = frame_key;
+    }
+    draw();
+    if (!replaying) { stats.quads += buf_idx; }
+    stats.frames++;
+    if (stats.uploads == 0) { stats.skipped_uploads++; }
     SDL_GL_SwapWindow(window);
 }
 
+
+void r_get_stats(RendererStats *s) {
+    *s = stats;
+}
+
+
 void r_close(void) {
+    if (gl_gen_buffers) {
+        gl_delete_buffers(1, &vbo);
+        gl_delete_buffers(1, &ibo);
+    }
     SDL_DestroyWindow(window);
 }
@@ -5,8 +5,25 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include <stdint.h>
 #include "microui.h"
 
+typedef struct RendererStats {
+    /* last frame */
+    int quads;
+    int culled;             /* outside the clip rect, dropped */
+    int trimmed;            /* partly outside, cut down */
+    int uploads;
+    int draw_calls;
+    int clip_batches;       /* draw calls with one per clip rect */
+
+    /* since r_init */
+    unsigned int frames;
+    unsigned int skipped_uploads;
+    unsigned int total_draw_calls;
+    unsigned int total_clip_batches;
+} RendererStats;
+
 void r_init(void);
 void r_draw_rect(mu_Rect rect, mu_Color color);
 void r_draw_text(const char *text, mu_Vec2 pos, mu_Color color);
@@ -14,8 +31,10 @@ void r_draw_icon(int id, mu_Rect rect, mu_Color color);
  int r_get_text_width(const char *text, int len);
  int r_get_text_height(void);
 void r_set_clip_rect(mu_Rect rect);
+ int r_begin_frame(uint64_t key);
 void r_clear(mu_Color color);
 void r_present(void);
+void r_get_stats(RendererStats *s);
 void r_close(void);
 
 #endif
@@ -0,0 +1,87 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "latch.h"
+
+void latch_reset(LatchState *l)
+{
+    l->pending = 0;
+    l->released = 0;
+    l->active = 0;
+}
+
+void latch_press(LatchState *l, int button, uint32_t timestamp)
+{
+    uint16_t bit = 1 << button;
+
+    l->pending |= bit;
+    l->released &= ~bit;
+    l->press_time[button] = timestamp;
+    ++l->presses;
+}
+
+void latch_release(LatchState *l, int button, uint32_t timestamp)
+{
+    uint16_t bit = 1 << button;
+
+    if (l->pending & bit) {
+        l->released |= bit;
+    }
+    l->release_time[button] = timestamp;
+}
+
+static void latch_next_frame(LatchState *l, const unsigned int hold[])
+{
+    for (uint16_t mask = l->active; mask; mask &= mask - 1) {
+        int b = __builtin_ctz(mask);
+        if (--l->frames[b] == 0) {
+            l->active &= ~(1 << b);
+        }
+    }
+
+    for (uint16_t mask = l->pending; mask; mask &= mask - 1) {
+        int b = __builtin_ctz(mask);
+        if (hold[b] == 0) {
+            continue;
+        }
+
+        l->frames[b] = hold[b] > UINT8_MAX ? UINT8_MAX : hold[b];
+        l->active |= 1 << b;
+
+        if (l->released & (1 << b)) {
+            // tapped between two polls, invisible without latching
+            uint32_t tap = l->release_time[b] - l->press_time[b];
+            if (l->saved == 0 || tap < l->shortest_tap) {
+                l->shortest_tap = tap;
+            }
+            ++l->saved;
+        }
+    }
+
+    l->pending = 0;
+    l->released = 0;
+}
+
+/* Returns the buttons to report for the current button level. new_frame
+   says the previous result was consumed by GetKeys: presses since then
+   start their minimum hold and held buttons lose one frame. Presses that
+   arrive mid-frame are reported right away, so with the sampler thread a
+   press may be reported for one frame more than its minimum hold. */
+uint16_t latch_apply(LatchState *l, uint16_t level, const unsigned int hold[], int new_frame)
+{
+    if (new_frame) {
+        latch_next_frame(l, hold);
+        return level | l->active;
+    }
+
+    uint16_t fresh = 0;
+    for (uint16_t mask = l->pending; mask; mask &= mask - 1) {
+        int b = __builtin_ctz(mask);
+        if (hold[b] != 0) {
+            fresh |= 1 << b;
+        }
+    }
+
+    return level | l->active | fresh;
+}
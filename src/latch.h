@@ -0,0 +1,36 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_LATCH_H_
+#define OCTOMINO_LATCH_H_
+
+#include <stdint.h>
+#include "sdl_input.h"
+
+/* Press latching. Button edges are recorded from SDL events, so a press
+   released again before the emulator polls still shows up: every press is
+   reported for at least one frame (one GetKeys read), or for a configurable
+   number of frames per button. */
+
+typedef struct LatchState
+{
+    uint16_t pending;   // pressed since the last frame
+    uint16_t released;  // ...and released again before it
+    uint16_t active;    // buttons with frames left to report
+    uint8_t frames[INPUTS_BUTTON_COUNT];
+
+    uint32_t press_time[INPUTS_BUTTON_COUNT];
+    uint32_t release_time[INPUTS_BUTTON_COUNT];
+
+    unsigned int presses;
+    unsigned int saved;         // presses that would have been dropped
+    uint32_t shortest_tap;      // ms between press and release of a saved press
+} LatchState;
+
+void latch_reset(LatchState *l);
+void latch_press(LatchState *l, int button, uint32_t timestamp);
+void latch_release(LatchState *l, int button, uint32_t timestamp);
+uint16_t latch_apply(LatchState *l, uint16_t level, const unsigned int hold[], int new_frame);
+
+#endif
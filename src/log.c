@@ -0,0 +1,243 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "log.h"
+#include "gui.h"
+#include "sdl_input.h"
+
+#define LOG_RING_SIZE 128   // power of two
+#define LOG_LINE_MAX  512
+
+typedef struct LogRecord
+{
+    // pos + 1 once written, pos + LOG_RING_SIZE once free for the next lap
+    atomic_uint seq;
+    time_t time;
+    char text[LOG_LINE_MAX];
+} LogRecord;
+
+static LogRecord ring[LOG_RING_SIZE];
+static atomic_uint enqueue_pos;
+static unsigned int dequeue_pos;
+static atomic_uint dropped;
+static unsigned int dropped_reported;
+
+static FILE *logfile;
+
+// held by whoever drains the ring; also guards logfile
+static CRITICAL_SECTION drain_lock;
+
+static HANDLE writer;
+static HMODULE writer_module;   // the writer's reference to this DLL
+static HANDLE wake_event;
+static atomic_int writer_running;
+static atomic_int writer_idle;
+static atomic_int stopping;
+
+static LogRecord *log_claim(void)
+{
+    unsigned int pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        LogRecord *r = &ring[pos & (LOG_RING_SIZE - 1)];
+        unsigned int seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                return r;
+            }
+        } else if (diff < 0) {
+            // the writer is a full lap behind
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int log_pending(void)
+{
+    LogRecord *r = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    return atomic_load(&r->seq) == dequeue_pos + 1;
+}
+
+/* drain_lock must be held */
+static void log_drain(void)
+{
+    static time_t last_time = -1;
+    static char timestr[9];
+    int wrote = 0;
+
+    while (log_pending()) {
+        LogRecord *r = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+
+        // timestamps only have second resolution, format them once per second
+        if (r->time != last_time) {
+            last_time = r->time;
+            strftime(timestr, sizeof(timestr), "%X", localtime(&last_time));
+        }
+        if (logfile != NULL) {
+            fprintf(logfile, "[%s] %s\n", timestr, r->text);
+        }
+        write_log(r->text);
+        wrote = 1;
+
+        atomic_store_explicit(&r->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        ++dequeue_pos;
+    }
+
+    unsigned int d = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (d != dropped_reported) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%u log messages dropped", d - dropped_reported);
+        if (logfile != NULL) {
+            fprintf(logfile, "[%s] %s\n", timestr, buf);
+        }
+        write_log(buf);
+        dropped_reported = d;
+        wrote = 1;
+    }
+
+    if (wrote && logfile != NULL) {
+        fflush(logfile);
+    }
+}
+
+static DWORD WINAPI log_writer(LPVOID param)
+{
+    while (!atomic_load(&stopping)) {
+        // announce the wait before the last check, so a producer either
+        // sees us idle and wakes us, or we see its record
+        atomic_store(&writer_idle, 1);
+        if (!log_pending()) {
+            WaitForSingleObject(wake_event, 1000);
+        }
+        atomic_store(&writer_idle, 0);
+
+        EnterCriticalSection(&drain_lock);
+        log_drain();
+        LeaveCriticalSection(&drain_lock);
+    }
+
+    // the DLL stays loaded until the last of its code here has run
+    FreeLibraryAndExitThread(writer_module, 0);
+    return 0;
+}
+
+void dlog(const char *fmt, ...)
+{
+    LogRecord *r = log_claim();
+    if (r == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    } else {
+        r->time = time(NULL);
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(r->text, sizeof(r->text), fmt, args);
+        va_end(args);
+
+        unsigned int pos = atomic_load_explicit(&r->seq, memory_order_relaxed);
+        atomic_store(&r->seq, pos + 1);
+    }
+
+    if (!atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        EnterCriticalSection(&drain_lock);
+        log_drain();
+        LeaveCriticalSection(&drain_lock);
+    } else if (atomic_exchange(&writer_idle, 0)) {
+        SetEvent(wake_event);
+    }
+}
+
+void log_open(const char *path)
+{
+    InitializeCriticalSection(&drain_lock);
+    for (unsigned int i = 0; i < LOG_RING_SIZE; ++i) {
+        atomic_init(&ring[i].seq, i);
+    }
+
+    logfile = fopen(path, "w");
+    if (logfile != NULL) {
+        setvbuf(logfile, NULL, _IOFBF, 16384);
+    }
+}
+
+void log_start(void)
+{
+    if (writer != NULL) {
+        return;
+    }
+
+    // pins the DLL while the writer runs, so a host that unloads it
+    // without calling CloseDLL can't pull the code out from under it
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+            (LPCSTR)&writer_module, &writer_module)) {
+        return;
+    }
+
+    atomic_store(&stopping, 0);
+    wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (wake_event == NULL) {
+        FreeLibrary(writer_module);
+        return;
+    }
+
+    writer = CreateThread(NULL, 0, log_writer, NULL, 0, NULL);
+    if (writer == NULL) {
+        CloseHandle(wake_event);
+        wake_event = NULL;
+        FreeLibrary(writer_module);
+        return;
+    }
+    atomic_store_explicit(&writer_running, 1, memory_order_release);
+}
+
+void log_stop(void)
+{
+    if (writer == NULL) {
+        return;
+    }
+
+    atomic_store_explicit(&writer_running, 0, memory_order_release);
+    atomic_store(&stopping, 1);
+    SetEvent(wake_event);
+    WaitForSingleObject(writer, INFINITE);
+    CloseHandle(writer);
+    CloseHandle(wake_event);
+    writer = NULL;
+    wake_event = NULL;
+
+    EnterCriticalSection(&drain_lock);
+    log_drain();
+    LeaveCriticalSection(&drain_lock);
+}
+
+void log_close(void)
+{
+    // runs under the loader lock, so the writer can't be waited for here.
+    // it holds a reference to the DLL, so it was either stopped by
+    // CloseDLL, or this is process exit and it has been terminated
+    atomic_store_explicit(&writer_running, 0, memory_order_release);
+    atomic_store(&stopping, 1);
+    if (wake_event != NULL) {
+        SetEvent(wake_event);
+    }
+
+    // at process exit the writer may have been killed holding the lock
+    if (TryEnterCriticalSection(&drain_lock)) {
+        log_drain();
+        if (logfile != NULL) {
+            fclose(logfile);
+            logfile = NULL;
+        }
+        LeaveCriticalSection(&drain_lock);
+    }
+}
@@ -0,0 +1,21 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_LOG_H_
+#define OCTOMINO_LOG_H_
+
+/* Asynchronous log. dlog formats into a slot of a bounded multi-producer
+   ring and returns; a writer thread drains the ring to the log file and
+   the GUI log. When the ring is full, lines are dropped and counted
+   instead of blocking the caller. Without a running writer (before
+   log_start, after log_stop) dlog drains the ring itself.
+   log_start is called once the emulator initializes the plugin, and
+   log_stop from CloseDLL; the writer keeps the DLL loaded until then. */
+
+void log_open(const char *path);
+void log_start(void);
+void log_stop(void);
+void log_close(void);
+
+#endif
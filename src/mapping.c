@@ -0,0 +1,330 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include "mapping.h"
+
+static enum ButtonAxis checked_source(enum ButtonAxis ba)
+{
+    if (ba < CONTROLLER_NOT_SET || ba >= CONTROLLER_ENUM_END) {
+        dlog("mapping_compile(): invalid ButtonAxis value %d", ba);
+        return CONTROLLER_NOT_SET;
+    }
+    return ba;
+}
+
+/* the inputs_t field a source is read from */
+static uint32_t source_input(enum ButtonAxis ba)
+{
+    switch (ba)
+    {
+        case CONTROLLER_NOT_SET:
+            return 0;
+        case CONTROLLER_LEFTX:
+        case CONTROLLER_LEFTX_MIN:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_LEFTX);
+        case CONTROLLER_LEFTY:
+        case CONTROLLER_LEFTY_MIN:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_LEFTY);
+        case CONTROLLER_RIGHTX:
+        case CONTROLLER_RIGHTX_MIN:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_RIGHTX);
+        case CONTROLLER_RIGHTY:
+        case CONTROLLER_RIGHTY_MIN:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_RIGHTY);
+        case CONTROLLER_LTRIG:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_TRIGGERLEFT);
+        case CONTROLLER_RTRIG:
+            return INPUTS_AXIS_BIT(SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
+        default:
+            // controller buttons are in SDL_GameControllerButton order
+            return INPUTS_BUTTON_BIT(ba - CONTROLLER_A);
+    }
+}
+
+static int32_t source_threshold(enum ButtonAxis ba, const ControllerConfig *cfg)
+{
+    if (ba < CONTROLLER_AXIS_BEGIN) {
+        return 0;
+    }
+
+    // same float expression as threshold(), so integer compares match it
+    float cutoff = ba < CONTROLLER_LTRIG ? cfg->a2d_threshold : cfg->a2d_trig;
+    float t = cutoff * 32767;
+    if (t < 0) {
+        return 0;
+    }
+    return t >= 32767 ? 32767 : (int32_t)t;
+}
+
+static void compile_button(MappingTerm *t, int bit, const ControllerMapping *m, const ControllerConfig *cfg)
+{
+    enum ButtonAxis p = checked_source(m->primary);
+    enum ButtonAxis s = checked_source(m->secondary);
+
+    t[0] = (MappingTerm){ p, bit, 0, source_threshold(p, cfg) };
+    t[1] = (MappingTerm){ s, bit, 0, source_threshold(s, cfg) };
+}
+
+static void compile_axis(MappingTerm *t, const ControllerMapping *plus, const ControllerMapping *minus)
+{
+    const ControllerMapping *m[] = { plus, plus, minus, minus };
+
+    for (int k = 0; k < MAPPING_AXIS_TERMS; ++k) {
+        enum ButtonAxis ba = checked_source(k & 1 ? m[k]->secondary : m[k]->primary);
+
+        // digital sources push the axis all the way, analog ones pass through
+        int16_t scale = 1;
+        if (ba < CONTROLLER_AXIS_BEGIN) {
+            scale = k < 2 ? 32767 : -32767;
+        }
+
+        t[k] = (MappingTerm){ ba, 0, scale, 0 };
+    }
+}
+
+static void compile_analog(MappingAnalog *a, const ControllerConfig *cfg)
+{
+    float deadzone = cfg->deadzone * 32767;
+    float span = cfg->outer_edge * 32767 - cfg->deadzone * 32767;
+
+    // scale_and_limit() stores the span in an int16_t
+    if (span > 32767) span = 32767;
+    if (span < -32768) span = -32768;
+
+    a->deadzone = (int64_t)(deadzone * 65536);
+    a->span = (int64_t)(int16_t)span << 16;
+    // the N64 axes are 8-bit, larger ranges would only wrap around
+    a->range = cfg->range > 127 ? 127 : cfg->range;
+    a->is_clamped = cfg->is_clamped;
+}
+
+static void release_gate(MappingGateTable *t)
+{
+    if (t != NULL && atomic_fetch_sub(&t->refs, 1) == 1) {
+        free(t);
+    }
+}
+
+/* returns 0 if there was no memory for a new table; the old one is kept */
+static int compile_gate(MappingGate *g, const ControllerConfig *cfg)
+{
+    int32_t c = cfg->gate_cardinal;
+    if (c < 1) c = 1;
+    if (c > 127) c = 127;
+
+    // keep the octagon convex
+    int32_t d = cfg->gate_diagonal;
+    if (d < (c + 1) / 2) d = (c + 1) / 2;
+    if (d > c) d = c;
+
+    // the table only depends on the notches, don't rebuild it for other edits
+    if (g->table != NULL && g->cardinal == c && g->diagonal == d) {
+        return 1;
+    }
+    MappingGateTable *t = malloc(sizeof(*t));
+    if (t == NULL) {
+        return 0;
+    }
+    atomic_init(&t->refs, 1);
+
+    for (int x = -128; x < 128; ++x) {
+        for (int y = -128; y < 128; ++y) {
+            int32_t ax = abs(x);
+            int32_t ay = abs(y);
+
+            // edge between the cardinal and the diagonal notch of this octant:
+            // d * major + (c - d) * minor = d * c
+            int32_t major = ax > ay ? ax : ay;
+            int32_t minor = ax > ay ? ay : ax;
+            int32_t num = d * c;
+            int32_t den = d * major + (c - d) * minor;
+
+            if (den > num) {
+                // round onto the edge, unless that lands outside the gate
+                int32_t rx = (ax * num + den / 2) / den;
+                int32_t ry = (ay * num + den / 2) / den;
+                int32_t rmajor = rx > ry ? rx : ry;
+                int32_t rminor = rx > ry ? ry : rx;
+
+                if (d * rmajor + (c - d) * rminor > num) {
+                    rx = ax * num / den;
+                    ry = ay * num / den;
+                }
+                ax = rx;
+                ay = ry;
+            }
+
+            int8_t *out = t->xy[(uint8_t)x][(uint8_t)y];
+            out[0] = x < 0 ? -ax : ax;
+            out[1] = y < 0 ? -ay : ay;
+        }
+    }
+
+    release_gate(g->table);
+    g->table = t;
+    g->cardinal = c;
+    g->diagonal = d;
+    return 1;
+}
+
+/* prog is either zeroed or holds a gate table of its own, see
+   mapping_share(). returns 0 when out of memory */
+int mapping_compile(MappingProgram *prog, const ControllerConfig *cfg)
+{
+    // BUTTONS bit order
+    const ControllerMapping *buttons[MAPPING_BUTTON_COUNT] = {
+        &cfg->dright, &cfg->dleft, &cfg->ddown, &cfg->dup,
+        &cfg->start,  &cfg->z,     &cfg->b,     &cfg->a,
+        &cfg->cright, &cfg->cleft, &cfg->cdown, &cfg->cup,
+        &cfg->r,      &cfg->l,
+    };
+
+    for (int k = 0; k < MAPPING_BUTTON_COUNT; ++k) {
+        compile_button(&prog->buttons[k * 2], k, buttons[k], cfg);
+    }
+
+    compile_axis(prog->x, &cfg->right, &cfg->left);
+    compile_axis(prog->y, &cfg->down, &cfg->up);
+
+    compile_analog(&prog->analog, cfg);
+    if (!compile_gate(&prog->gate, cfg)) {
+        return 0;
+    }
+
+    // only these need to be read from the controller
+    prog->sources = 0;
+    for (int k = 0; k < MAPPING_BUTTON_COUNT * 2; ++k) {
+        prog->sources |= source_input(prog->buttons[k].source);
+    }
+    for (int k = 0; k < MAPPING_AXIS_TERMS; ++k) {
+        prog->sources |= source_input(prog->x[k].source) | source_input(prog->y[k].source);
+    }
+    return 1;
+}
+
+/* copies a program; the copy takes a reference to the gate table */
+void mapping_share(MappingProgram *dst, const MappingProgram *src)
+{
+    *dst = *src;
+    if (dst->gate.table != NULL) {
+        atomic_fetch_add(&dst->gate.table->refs, 1);
+    }
+}
+
+void mapping_release(MappingProgram *prog)
+{
+    release_gate(prog->gate.table);
+    prog->gate.table = NULL;
+}
+
+static void fill_sources(int16_t *src, const inputs_t *i)
+{
+    src[CONTROLLER_NOT_SET] = 0;
+
+    for (int k = 0; k < INPUTS_BUTTON_COUNT; ++k) {
+        src[CONTROLLER_A + k] = (i->buttons >> k) & 1;
+    }
+
+    src[CONTROLLER_LEFTX]      = smin(i->alx, 0);
+    src[CONTROLLER_LEFTY]      = smin(i->aly, 0);
+    src[CONTROLLER_RIGHTX]     = smin(i->arx, 0);
+    src[CONTROLLER_RIGHTY]     = smin(i->ary, 0);
+    src[CONTROLLER_LEFTX_MIN]  = smax(i->alx, 0);
+    src[CONTROLLER_LEFTY_MIN]  = smax(i->aly, 0);
+    src[CONTROLLER_RIGHTX_MIN] = smax(i->arx, 0);
+    src[CONTROLLER_RIGHTY_MIN] = smax(i->ary, 0);
+    src[CONTROLLER_LTRIG]      = i->altrig;
+    src[CONTROLLER_RTRIG]      = i->artrig;
+}
+
+static inline int16_t run_axis(const MappingTerm *t, const int16_t *src)
+{
+    int32_t axis = 0;
+    for (int k = 0; k < MAPPING_AXIS_TERMS; ++k) {
+        axis += t[k].scale * src[t[k].source];
+    }
+
+    if (axis > 32767) return 32767;
+    if (axis < -32768) return -32768;
+    return axis;
+}
+
+uint32_t mapping_run(const MappingProgram *prog, const inputs_t *i, int16_t *x, int16_t *y)
+{
+    int16_t src[CONTROLLER_ENUM_END];
+    fill_sources(src, i);
+
+    uint32_t value = 0;
+    for (int k = 0; k < MAPPING_BUTTON_COUNT * 2; ++k) {
+        const MappingTerm *t = &prog->buttons[k];
+        value |= (uint32_t)(abs(src[t->source]) > t->threshold) << t->bit;
+    }
+
+    *x = run_axis(prog->x, src);
+    *y = run_axis(prog->y, src);
+
+    return value;
+}
+
+static inline int32_t scale_axis(int16_t v, int64_t n, int64_t span)
+{
+    if (v == 0 || n <= 0) {
+        return 0;
+    }
+
+    int32_t res = n * 32767 / span;
+    return v < 0 ? -res : res;
+}
+
+/* Fixed-point version of scale_and_limit() followed by n64_analog().
+   Deadzone, outer edge and range are evaluated as exact integer ratios,
+   while the float path rounds the intermediate ratio before truncating.
+   Clamping is the same gate table lookup in both, so they only differ
+   in the position looked up, by at most 1 per axis:
+   - inputs whose exact result lies within float precision of an integer
+     (a few per million random inputs);
+   - a stick pushed past the outer edge on an exact diagonal reaches full
+     deflection on both axes, where the float path often ends one below.
+   Past the gate edge such a position maps onto a neighbouring point of
+   the edge, which can differ by 1 on either axis.
+   An outer edge/deadzone span outside int16_t is clamped instead of
+   overflowing as in scale_and_limit(). */
+uint32_t mapping_analog(const MappingProgram *prog, int16_t x, int16_t y)
+{
+    const MappingAnalog *a = &prog->analog;
+
+    int32_t sx = x;
+    int32_t sy = y;
+
+    if (a->span != 0) {
+        int64_t nx = ((int64_t)abs(x) << 16) - a->deadzone;
+        int64_t ny = ((int64_t)abs(y) << 16) - a->deadzone;
+        int64_t span = a->span;
+
+        if (span < 0) {
+            nx = -nx;
+            ny = -ny;
+            span = -span;
+        }
+
+        // out of range: scale both axes down by the larger one
+        if (nx > span) span = nx;
+        if (ny > span) span = ny;
+
+        sx = scale_axis(x, nx, span);
+        sy = scale_axis(y, ny, span);
+    }
+
+    int16_t n64_x = sx * a->range / 32767;
+    int16_t n64_y = sy * a->range / 32767;
+
+    if (a->is_clamped) {
+        const int8_t *gated = mapping_gate(prog, n64_x, n64_y);
+        n64_x = gated[0];
+        n64_y = gated[1];
+    }
+
+    return (uint32_t)(uint8_t)n64_x << 16 | (uint32_t)(uint8_t)-n64_y << 24;
+}
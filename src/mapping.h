@@ -0,0 +1,87 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_MAPPING_H_
+#define OCTOMINO_MAPPING_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "config.h"
+#include "sdl_input.h"
+
+#define MAPPING_BUTTON_COUNT 14
+#define MAPPING_AXIS_TERMS   4
+
+/* A ControllerConfig compiled into a flat table. Every N64 button is two
+   terms (primary and secondary), every N64 stick axis is four terms (both
+   mappings of the plus and minus direction). Terms index a table of source
+   values built once per poll, so evaluation needs no per-input switch. */
+
+typedef struct MappingTerm
+{
+    uint8_t source;     // enum ButtonAxis, index into the source table
+    uint8_t bit;        // BUTTONS bit the term sets (digital terms only)
+    int16_t scale;      // multiplier applied to the source (analog terms only)
+    int32_t threshold;  // |source| has to exceed this (digital terms only)
+} MappingTerm;
+
+/* Stick parameters for the fixed-point analog chain. The deadzone keeps
+   16 fractional bits so the result is the exact rational value the float
+   path approximates; see mapping_analog(). */
+
+typedef struct MappingAnalog
+{
+    int64_t deadzone;   // deadzone * 32767, Q16
+    int64_t span;       // (outer edge - deadzone) * 32767, truncated like scale_and_limit(), Q16
+    int32_t range;
+    int32_t is_clamped;
+} MappingAnalog;
+
+/* N64 octagonal gate, indexed by the post-range stick position. Positions
+   outside the octagon are pulled back along the same direction onto its
+   edge. The diagonal notch is given as the coordinate on each axis.
+   The table only depends on the notches, so programs copied with
+   mapping_share() use the same one; it is never modified once built. */
+
+typedef struct MappingGateTable
+{
+    atomic_uint refs;
+    int8_t xy[256][256][2];
+} MappingGateTable;
+
+typedef struct MappingGate
+{
+    int32_t cardinal;
+    int32_t diagonal;
+    MappingGateTable *table;    // NULL until compiled
+} MappingGate;
+
+typedef struct MappingProgram
+{
+    MappingTerm buttons[MAPPING_BUTTON_COUNT * 2];
+    MappingTerm x[MAPPING_AXIS_TERMS];
+    MappingTerm y[MAPPING_AXIS_TERMS];
+
+    MappingAnalog analog;
+    MappingGate gate;
+
+    uint32_t sources;   // inputs_t fields the terms read, see INPUTS_ALL
+} MappingProgram;
+
+int mapping_compile(MappingProgram *prog, const ControllerConfig *cfg);
+void mapping_share(MappingProgram *dst, const MappingProgram *src);
+void mapping_release(MappingProgram *prog);
+uint32_t mapping_run(const MappingProgram *prog, const inputs_t *i, int16_t *x, int16_t *y);
+uint32_t mapping_analog(const MappingProgram *prog, int16_t x, int16_t y);
+
+static inline const int8_t *mapping_gate(const MappingProgram *prog, int16_t x, int16_t y)
+{
+    static const int8_t neutral[2];
+    if (prog->gate.table == NULL) {
+        return neutral;
+    }
+    return prog->gate.table->xy[(uint8_t)x][(uint8_t)y];
+}
+
+#endif
@@ -0,0 +1,56 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include "retry.h"
+
+static uint32_t jitter_state;
+
+static uint32_t random_u32(void)
+{
+    // xorshift32, seeded from the performance counter
+    uint32_t x = jitter_state;
+    if (x == 0) {
+        LARGE_INTEGER t;
+        QueryPerformanceCounter(&t);
+        x = (uint32_t)t.QuadPart | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    jitter_state = x;
+    return x;
+}
+
+int retry_due(Retry *r)
+{
+    if (atomic_load_explicit(&r->failures, memory_order_relaxed) == 0) {
+        return 1;
+    }
+    uint32_t next = atomic_load_explicit(&r->next, memory_order_relaxed);
+    return (int32_t)(GetTickCount() - next) >= 0;
+}
+
+void retry_failed(Retry *r)
+{
+    uint32_t delay = atomic_load_explicit(&r->delay, memory_order_relaxed);
+    delay = delay == 0 ? r->base_ms : delay * 2;
+    if (delay > r->max_ms) {
+        delay = r->max_ms;
+    }
+    atomic_store_explicit(&r->delay, delay, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->failures, 1, memory_order_relaxed);
+
+    // wait somewhere between half and all of the delay, so retries of
+    // several instances don't line up
+    uint32_t wait = delay / 2 + random_u32() % (delay / 2 + 1);
+    atomic_store_explicit(&r->next, GetTickCount() + wait, memory_order_relaxed);
+}
+
+void retry_reset(Retry *r)
+{
+    atomic_store_explicit(&r->delay, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->failures, 0, memory_order_relaxed);
+}
@@ -0,0 +1,31 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_RETRY_H_
+#define OCTOMINO_RETRY_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Exponential backoff for things worth retrying, like SDL init or looking
+   for a controller. Each failure doubles the delay up to a limit, with
+   jitter; a reset makes the next attempt due right away. Checking
+   whether an attempt is due is a tick count comparison. */
+
+typedef struct Retry
+{
+    uint32_t base_ms;
+    uint32_t max_ms;
+    _Atomic uint32_t next;      // GetTickCount value of the next attempt
+    _Atomic uint32_t delay;
+    atomic_uint failures;       // since the last reset
+} Retry;
+
+#define RETRY_INIT(base, max) { (base), (max), 0, 0, 0 }
+
+int retry_due(Retry *r);
+void retry_failed(Retry *r);
+void retry_reset(Retry *r);
+
+#endif
@@ -0,0 +1,420 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <timeapi.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "sampler.h"
+#include "sdl_input.h"
+
+static SRWLOCK control_lock = SRWLOCK_INIT;
+
+static sampler_fn sample;
+static atomic_uint rate;    // picked up by the running thread every period
+static HANDLE thread;
+static HANDLE stop_event;
+static HANDLE first_event;  // set once the thread has published
+
+// set while the sampler thread owns input, from before its first sample
+// until it has exited; GetKeys doesn't sample by itself meanwhile
+static atomic_int owned;
+// set by GetKeys while it samples by itself
+static atomic_int direct_busy;
+// what GetKeys last sampled by itself, reading thread only
+static uint32_t direct_last[PORT_COUNT];
+
+// sequence number << 32 | BUTTONS value, per port; 0 while the sampler
+// isn't running
+static _Atomic uint64_t latest[PORT_COUNT];
+// sequence number of the last value GetKeys read
+static _Atomic uint32_t consumed;
+
+// GetKeys calls a millisecond or more apart start a new emulator frame;
+// the first call of each is left here for the sampler thread
+static _Atomic int64_t read_time;
+static _Atomic uint32_t read_seq;
+static _Atomic uint32_t read_frames;
+static int64_t read_frame_start;    // reading thread only
+static uint32_t read_frame_count;   // reading thread only
+
+static uint32_t seq;
+static uint32_t frame_seq;
+
+// QPC time of recent publishes, indexed by the low bits of their sequence
+static _Atomic int64_t publish_time[4];
+
+static int64_t qpc_freq;
+static int64_t qpc_ms;      // ticks per millisecond
+
+// GetKeys cadence estimate, sampler thread only
+static struct {
+    uint32_t frames;    // read_frames already accounted for
+    int64_t last;
+    int64_t period;
+    int64_t jitter;
+    int64_t age;
+    unsigned int count;
+} est;
+
+// published estimate, in QPC ticks; next_read is 0 while not locked
+static _Atomic int64_t next_read;
+static _Atomic int64_t est_period;
+static _Atomic int64_t est_jitter;
+static _Atomic int64_t est_age;
+static atomic_int locked;
+
+static atomic_int jit;
+static atomic_uint jit_margin_us;
+
+// average time a sample takes, sampler thread only
+static int64_t sample_cost;
+
+static int64_t qpc_now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+static float qpc_to_ms(int64_t t)
+{
+    return (float)t * 1000.0f / (float)qpc_freq;
+}
+
+static void sampler_publish(void)
+{
+    // a new frame starts once GetKeys read anything published in this one
+    uint32_t read = atomic_load_explicit(&consumed, memory_order_relaxed);
+    int new_frame = (int32_t)(read - frame_seq) >= 0;
+
+    int64_t start = qpc_now();
+    uint32_t values[PORT_COUNT] = {0};
+    sample(values, new_frame);
+    int64_t end = qpc_now();
+
+    sample_cost += (end - start - sample_cost) / 8;
+
+    // 0 is left for "nothing published yet"
+    if (++seq == 0) {
+        ++seq;
+    }
+    if (new_frame) {
+        frame_seq = seq;
+    }
+    atomic_store_explicit(&publish_time[seq & 3], end, memory_order_relaxed);
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        atomic_store_explicit(&latest[p], (uint64_t)seq << 32 | values[p], memory_order_release);
+    }
+}
+
+/* Picks the moment to sample for the next predicted GetKeys call, so the
+   sample finishes just ahead of it. Returns 0 when the cadence is unknown. */
+static int64_t jit_target(int64_t *served)
+{
+    int64_t next = atomic_load_explicit(&next_read, memory_order_acquire);
+    int64_t period = atomic_load_explicit(&est_period, memory_order_relaxed);
+    if (!atomic_load_explicit(&jit, memory_order_relaxed) || next == 0) {
+        return 0;
+    }
+
+    int64_t lead = sample_cost
+        + 2 * atomic_load_explicit(&est_jitter, memory_order_relaxed)
+        + (int64_t)atomic_load_explicit(&jit_margin_us, memory_order_relaxed)
+          * qpc_freq / 1000000;
+
+    // the read we already sampled for hasn't happened yet, or the emulator
+    // is stalled; either way aim at the next one that is still ahead
+    int64_t now = qpc_now();
+    if (next <= *served) {
+        next = *served + period;
+    }
+    while (next - lead <= now) {
+        next += period;
+    }
+
+    *served = next;
+    return next - lead;
+}
+
+static void estimate_cadence(void);
+
+static DWORD WINAPI sampler_thread(LPVOID param)
+{
+    int64_t served = 0;
+
+    timeBeginPeriod(1);
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+
+    // sampler_start waits for this first one
+    sampler_publish();
+    SetEvent(first_event);
+
+    for (;;) {
+        unsigned int r = atomic_load_explicit(&rate, memory_order_relaxed);
+        estimate_cadence();
+        int64_t target = jit_target(&served);
+        DWORD wait = r != 0 ? 1000 / r : INFINITE;
+
+        if (target != 0) {
+            // sleep to within a millisecond of the target and spin the rest
+            int64_t ms = (target - qpc_now()) * 1000 / qpc_freq - 1;
+            wait = ms > 0 ? (DWORD)ms : 0;
+        }
+
+        if (WaitForSingleObject(stop_event, wait) != WAIT_TIMEOUT) {
+            break;
+        }
+
+        if (target != 0) {
+            while (qpc_now() < target) {
+                SwitchToThread();
+            }
+        }
+
+        sampler_publish();
+    }
+
+    timeEndPeriod(1);
+    return 0;
+}
+
+static void sampler_start(void)
+{
+    if (thread != NULL || sample == NULL || atomic_load(&rate) == 0) {
+        return;
+    }
+
+    stop_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    first_event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (stop_event == NULL || first_event == NULL) {
+        dlog("Unable to start the input sampler: CreateEvent failed");
+        if (stop_event != NULL) {
+            CloseHandle(stop_event);
+        }
+        if (first_event != NULL) {
+            CloseHandle(first_event);
+        }
+        stop_event = first_event = NULL;
+        return;
+    }
+
+    if (qpc_freq == 0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        qpc_freq = f.QuadPart;
+        qpc_ms = qpc_freq / 1000;
+    }
+
+    seq = 0;
+    frame_seq = 0;
+    sample_cost = 0;
+    memset(&est, 0, sizeof(est));
+    est.frames = atomic_load_explicit(&read_frames, memory_order_relaxed);
+    atomic_store_explicit(&next_read, 0, memory_order_relaxed);
+    atomic_store_explicit(&est_period, 0, memory_order_relaxed);
+    atomic_store_explicit(&est_jitter, 0, memory_order_relaxed);
+    atomic_store_explicit(&est_age, 0, memory_order_relaxed);
+    atomic_store_explicit(&locked, 0, memory_order_relaxed);
+    atomic_store_explicit(&consumed, 0, memory_order_relaxed);
+
+    thread = CreateThread(NULL, 0, sampler_thread, NULL, CREATE_SUSPENDED, NULL);
+    if (thread == NULL) {
+        dlog("Unable to start the input sampler: CreateThread failed");
+        CloseHandle(stop_event);
+        CloseHandle(first_event);
+        stop_event = first_event = NULL;
+        return;
+    }
+
+    // take input over from GetKeys. it marks a pass of its own before
+    // checking owned, and flushing every CPU's write buffers makes sure
+    // it either saw owned or its mark is visible here; so once no pass
+    // is marked, none will start
+    atomic_store_explicit(&owned, 1, memory_order_relaxed);
+    FlushProcessWriteBuffers();
+    while (atomic_load_explicit(&direct_busy, memory_order_acquire)) {
+        SwitchToThread();
+    }
+
+    // GetKeys keeps its last values until the first sample is published
+    ResumeThread(thread);
+    WaitForSingleObject(first_event, INFINITE);
+
+    dlog("Input sampler running at %u Hz", atomic_load(&rate));
+}
+
+static void sampler_stop(void)
+{
+    if (thread == NULL) {
+        return;
+    }
+
+    // GetKeys goes back to sampling by itself only once the thread is gone
+    SetEvent(stop_event);
+    WaitForSingleObject(thread, INFINITE);
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        atomic_store_explicit(&latest[p], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&owned, 0, memory_order_release);
+    CloseHandle(thread);
+    CloseHandle(stop_event);
+    CloseHandle(first_event);
+    thread = NULL;
+    stop_event = first_event = NULL;
+
+    SamplerTiming t;
+    sampler_get_timing(&t);
+    if (t.locked) {
+        dlog("Input sampler stopped; GetKeys period %.3f ms, jitter %.3f ms, "
+             "sample age %.3f ms", t.period_ms, t.jitter_ms, t.age_ms);
+    } else {
+        dlog("Input sampler stopped");
+    }
+}
+
+void sampler_open(sampler_fn fn)
+{
+    AcquireSRWLockExclusive(&control_lock);
+    sample = fn;
+    sampler_start();
+    ReleaseSRWLockExclusive(&control_lock);
+}
+
+void sampler_close(void)
+{
+    AcquireSRWLockExclusive(&control_lock);
+    sampler_stop();
+    sample = NULL;
+    ReleaseSRWLockExclusive(&control_lock);
+}
+
+void sampler_set_rate(unsigned int new_rate)
+{
+    if (new_rate > SAMPLER_RATE_MAX) {
+        new_rate = SAMPLER_RATE_MAX;
+    }
+
+    // a running thread just picks the new rate up, so dragging the slider
+    // only starts or stops it when crossing 0
+    AcquireSRWLockExclusive(&control_lock);
+    atomic_store_explicit(&rate, new_rate, memory_order_relaxed);
+    if (new_rate == 0) {
+        sampler_stop();
+    } else {
+        sampler_start();
+    }
+    ReleaseSRWLockExclusive(&control_lock);
+}
+
+void sampler_set_jit(int enabled, unsigned int margin_us)
+{
+    atomic_store_explicit(&jit_margin_us, margin_us, memory_order_relaxed);
+    atomic_store_explicit(&jit, enabled, memory_order_relaxed);
+}
+
+/* Tracks GetKeys timing with a simple loop filter: the period follows the
+   measured interval, and each frame re-anchors the phase. Runs on the
+   sampler thread, from the frame starts GetKeys leaves in read_time. */
+static void estimate_cadence(void)
+{
+    uint32_t frames = atomic_load_explicit(&read_frames, memory_order_relaxed);
+    if (frames == est.frames) {
+        return;
+    }
+    int64_t now = atomic_load_explicit(&read_time, memory_order_relaxed);
+    uint32_t s = atomic_load_explicit(&read_seq, memory_order_relaxed);
+    uint32_t passed = frames - est.frames;
+    est.frames = frames;
+
+    int64_t age = now - atomic_load_explicit(&publish_time[s & 3], memory_order_relaxed);
+    int64_t prev = est.last;
+    // several frames can go by between two looks at them
+    int64_t dt = (now - prev) / passed;
+
+    est.last = now;
+    est.age += ((age > 0 ? age : 0) - est.age) / 16;
+    atomic_store_explicit(&est_age, est.age, memory_order_relaxed);
+
+    if (prev == 0) {
+        // first frame, only the phase is known
+        return;
+    }
+    if (est.period == 0 || (dt > 4 * est.period && est.count < 16)) {
+        est.period = dt;
+        est.jitter = 0;
+        est.count = 1;
+        return;
+    }
+    if (dt > 4 * est.period) {
+        // the emulator was paused; keep the period and re-anchor the phase
+        atomic_store_explicit(&next_read, now + est.period, memory_order_release);
+        return;
+    }
+
+    int64_t err = dt - est.period;
+    est.period += err / 16;
+    est.jitter += ((err < 0 ? -err : err) - est.jitter) / 16;
+    if (est.count < 16) {
+        ++est.count;
+    }
+
+    int is_locked = est.count >= 16 && est.jitter < est.period / 8;
+    atomic_store_explicit(&est_period, est.period, memory_order_relaxed);
+    atomic_store_explicit(&est_jitter, est.jitter, memory_order_relaxed);
+    atomic_store_explicit(&next_read, is_locked ? now + est.period : 0,
+                          memory_order_release);
+
+    if (is_locked && !atomic_load_explicit(&locked, memory_order_relaxed)) {
+        dlog("GetKeys cadence locked: period %.3f ms, jitter %.3f ms",
+             qpc_to_ms(est.period), qpc_to_ms(est.jitter));
+    }
+    atomic_store_explicit(&locked, is_locked, memory_order_relaxed);
+}
+
+/* while the sampler runs, this is one load of the published value plus
+   a few relaxed stores for the sampler thread to pick up */
+uint32_t sampler_read(int port, uint32_t (*direct)(int port))
+{
+    uint64_t v = atomic_load_explicit(&latest[port], memory_order_acquire);
+    if (v != 0) {
+        uint32_t s = v >> 32;
+        atomic_store_explicit(&consumed, s, memory_order_relaxed);
+
+        // calls less than a millisecond apart belong to the same frame,
+        // one per port; only the first of each counts for the cadence
+        int64_t now = qpc_now();
+        if (now - read_frame_start >= qpc_ms) {
+            read_frame_start = now;
+            atomic_store_explicit(&read_time, now, memory_order_relaxed);
+            atomic_store_explicit(&read_seq, s, memory_order_relaxed);
+            atomic_store_explicit(&read_frames, ++read_frame_count, memory_order_relaxed);
+        }
+        return (uint32_t)v;
+    }
+
+    // mark the pass before checking whether the sampler thread is taking
+    // over, see sampler_start; until it has published, repeat the last
+    // values
+    atomic_store_explicit(&direct_busy, 1, memory_order_relaxed);
+    atomic_signal_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&owned, memory_order_relaxed)) {
+        direct_last[port] = direct(port);
+    }
+    atomic_store_explicit(&direct_busy, 0, memory_order_release);
+    return direct_last[port];
+}
+
+void sampler_get_timing(SamplerTiming *t)
+{
+    t->locked = atomic_load_explicit(&locked, memory_order_relaxed);
+    if (qpc_freq == 0) {
+        t->period_ms = t->jitter_ms = t->age_ms = 0.0f;
+        return;
+    }
+    t->period_ms = qpc_to_ms(atomic_load_explicit(&est_period, memory_order_relaxed));
+    t->jitter_ms = qpc_to_ms(atomic_load_explicit(&est_jitter, memory_order_relaxed));
+    t->age_ms = qpc_to_ms(atomic_load_explicit(&est_age, memory_order_relaxed));
+}
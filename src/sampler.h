@@ -0,0 +1,43 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_SAMPLER_H_
+#define OCTOMINO_SAMPLER_H_
+
+#include <stdint.h>
+#include "config.h"
+
+/* Background input sampler. While a ROM is open and a sampling rate is
+   set, a dedicated thread owns SDL polling and publishes a fully mapped
+   BUTTONS value per port, so GetKeys only has to load it. The sample function is
+   told when GetKeys has consumed a value since the last frame, which is
+   when latched presses may advance.
+
+   GetKeys calls also feed a period/phase estimate of the emulator's
+   polling cadence. In just-in-time mode the sampler uses it to finish a
+   sample shortly before the predicted next call instead of on a fixed
+   timer, falling back to the fixed rate until the estimate locks. */
+
+#define SAMPLER_RATE_MAX 1000
+
+typedef void (*sampler_fn)(uint32_t values[PORT_COUNT], int new_frame);
+
+typedef struct SamplerTiming
+{
+    int locked;
+    float period_ms;
+    float jitter_ms;
+    float age_ms;
+} SamplerTiming;
+
+void sampler_open(sampler_fn fn);
+void sampler_close(void);
+void sampler_set_rate(unsigned int rate);
+void sampler_set_jit(int enabled, unsigned int margin_us);
+/* the sampler's latest value for the port; while it isn't running,
+   direct is called instead. the two never sample at the same time */
+uint32_t sampler_read(int port, uint32_t (*direct)(int port));
+void sampler_get_timing(SamplerTiming *t);
+
+#endif
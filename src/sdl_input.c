@@ -6,55 +6,385 @@
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_gamecontroller.h>
-#include <stdarg.h>
-#include <time.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include "gui.h"
+#include "config.h"
+#include "snapshot.h"
+#include "epoch.h"
+#include "latch.h"
+#include "stats.h"
+#include "gcdb.h"
+#include "retry.h"
+#include "devices.h"
+#include "events.h"
 
 CRITICAL_SECTION critical_section; 
 
-FILE *logfile;
 char dbpath[PATH_MAX];
 
 int initialized = 0;
-SDL_GameController *con = NULL;
-int joy_inst = -1;
 
-void try_init(void)
+/* set once the background init is done and the first controller open was
+   attempted; until then inputs read as neutral */
+static atomic_int ready;
+static atomic_int init_running;
+
+/* backoff for failed SDL init, and for looking for a controller while
+   there is none; hotplug events and user actions reset them */
+static Retry init_retry = RETRY_INIT(250, 10000);
+static Retry open_retry = RETRY_INIT(250, 4000);
+
+/* device worker: opens and closes controllers off the emulator thread */
+#define DEVICE_CLOSE_MAX 8
+static HANDLE device_thread;
+static HANDLE device_event;
+static atomic_int device_stop;
+static atomic_int open_requested;
+static atomic_int open_hint = -1;      // device index to try first
+static SDL_GameController *close_queue[DEVICE_CLOSE_MAX];
+static int close_count;
+
+static void device_start(void);
+static void device_stop_worker(void);
+
+#define PORT_DEVICES_MAX 4
+
+/* a controller in use on one of the ports. readers reach it through the
+   port table without locking; once it's taken out of use it is retired,
+   and the handle is closed after the last of them has left */
+typedef struct PortDevice
 {
+    SDL_GameController *con;
+    SDL_JoystickID joy_inst;
+    DeviceInfo info;        // cached at open, guarded by critical_section
+    uint32_t present;       // inputs_t fields the controller has
+
+    // event-driven mode: inputs kept up to date from SDL_CONTROLLER*
+    // events, reseeded by polling whenever they're invalid. only the
+    // thread reading inputs touches these, the sampler or else GetKeys
+    inputs_t state;
+    int state_valid;
+} PortDevice;
+
+/* the controllers on an N64 port. inputs of all devices on a port are
+   merged before mapping */
+typedef struct Port
+{
+    PortDevice *dev[PORT_DEVICES_MAX];
+    int count;
+} Port;
+
+/* a published table is never modified. changes are made to a copy, with
+   critical_section held, which then replaces it */
+typedef struct PortTable
+{
+    Port port[PORT_COUNT];
+    unsigned int version;
+} PortTable;
+
+static PortTable empty_table;
+static PortTable *_Atomic port_table = &empty_table;
+
+/* press latching per port, fed by button events, guarded by critical_section */
+static LatchState latches[PORT_COUNT];
+
+static int event_inputs = 0;
+static int latching = 0;
+
+/* SDL timestamp of the newest input event not yet seen by GetKeys */
+static _Atomic uint32_t event_time;
+
+/* input generation of each port, moved on by input events and by polled
+   states that differ from the last one read; owned by the thread reading
+   inputs, like the device states */
+static unsigned int input_gen[PORT_COUNT];
+static inputs_t input_last[PORT_COUNT];
+static unsigned int table_seen;
+
+/* readers call this between epoch_enter() and epoch_exit(); writers get
+   the table they're about to replace, with critical_section held */
+static PortTable *table_get(void)
+{
+    return atomic_load_explicit(&port_table, memory_order_acquire);
+}
+
+/* NULL when out of memory, and the current table stays as it is */
+static PortTable *table_copy(void)
+{
+    PortTable *t = malloc(sizeof(*t));
+    if (t != NULL) {
+        *t = *table_get();
+        ++t->version;
+    }
+    return t;
+}
+
+/* returns the replaced table for table_retire(), which is called once
+   critical_section is left: retiring may wait for the readers */
+static PortTable *table_publish(PortTable *t)
+{
+    return atomic_exchange(&port_table, t);
+}
+
+static void table_retire(PortTable *old)
+{
+    if (old != NULL && old != &empty_table) {
+        epoch_retire(old, free);
+    }
+}
+
+/* no reader can still use a retired device: the device worker closes
+   its handle, or it's closed right here if there is no worker */
+static void device_destroy(void *p)
+{
+    PortDevice *d = p;
+
     EnterCriticalSection(&critical_section);
+    int queued = device_thread != NULL && close_count < DEVICE_CLOSE_MAX;
+    if (queued) {
+        close_queue[close_count++] = d->con;
+        SetEvent(device_event);
+    }
+    LeaveCriticalSection(&critical_section);
+
+    if (!queued) {
+        SDL_GameControllerClose(d->con);
+    }
+    free(d);
+}
 
+static PortDevice *find_device(const PortTable *t, SDL_JoystickID inst, int *port)
+{
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        for (int d = 0; d < t->port[p].count; ++d) {
+            if (t->port[p].dev[d]->joy_inst == inst) {
+                *port = p;
+                return t->port[p].dev[d];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* what the device code needs from the published settings, copied out
+   so it isn't held across slow SDL calls */
+typedef struct DeviceSettings
+{
+    int plugged;        // plugged ports, as a bitmask
+    int latching;       // ports that latch presses, as a bitmask
+    int event_inputs;
+} DeviceSettings;
+
+static DeviceSettings device_settings(void)
+{
+    int epoch = epoch_enter();
+    const ConfigSnapshot *snap = snapshot_get();
+
+    DeviceSettings s = { 0, 0, snap->plugin.event_inputs };
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        s.plugged |= snap->con[p].plugged ? 1 << p : 0;
+        s.latching |= snap->con[p].latching ? 1 << p : 0;
+    }
+
+    epoch_exit(epoch);
+    return s;
+}
+
+/* plugged ports without a controller, as a bitmask */
+static int free_ports(const PortTable *t, int plugged)
+{
+    int mask = 0;
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        if ((plugged & (1 << p)) && t->port[p].count == 0) {
+            mask |= 1 << p;
+        }
+    }
+    return mask;
+}
+
+/* rank of the device on a port if a more preferred one may take its
+   place, which is when it's alone there and not bound to it; else -1 */
+static int replaceable_rank(const PortTable *t, int plugged, int port)
+{
+    const Port *pt = &t->port[port];
+    if (!(plugged & (1 << port)) || pt->count != 1 || devices_get_port(&pt->dev[0]->info) != -1) {
+        return -1;
+    }
+    int r = devices_find(&pt->dev[0]->info);
+    return r == -1 ? DEVICES_MAX : r;
+}
+
+static int bound_port_open(const PortTable *t, int plugged, int bound)
+{
+    return bound >= 0 && bound < PORT_COUNT && (plugged & (1 << bound))
+        && t->port[bound].count < PORT_DEVICES_MAX;
+}
+
+static void disable_unused_events(void)
+{
+    // SDL_JOY* axis/hat/button events have to stay available: the
+    // GameController layer derives its own events from them
+    SDL_EventState(SDL_JOYBALLMOTION, SDL_IGNORE);
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    SDL_EventState(SDL_CONTROLLERTOUCHPADDOWN, SDL_IGNORE);
+    SDL_EventState(SDL_CONTROLLERTOUCHPADMOTION, SDL_IGNORE);
+    SDL_EventState(SDL_CONTROLLERTOUCHPADUP, SDL_IGNORE);
+    SDL_EventState(SDL_CONTROLLERSENSORUPDATE, SDL_IGNORE);
+#endif
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    SDL_EventState(SDL_JOYBATTERYUPDATED, SDL_IGNORE);
+#endif
+}
+
+static void set_event_inputs(int enabled, int latch_enabled)
+{
+    // in polled mode nothing reads input events, so don't queue them at all;
+    // latching only needs the button edges
+    int axes = enabled ? SDL_ENABLE : SDL_IGNORE;
+    int buttons = enabled || latch_enabled ? SDL_ENABLE : SDL_IGNORE;
+    SDL_EventState(SDL_JOYAXISMOTION, buttons);
+    SDL_EventState(SDL_JOYHATMOTION, buttons);
+    SDL_EventState(SDL_JOYBUTTONDOWN, buttons);
+    SDL_EventState(SDL_JOYBUTTONUP, buttons);
+    SDL_EventState(SDL_CONTROLLERAXISMOTION, axes);
+    SDL_EventState(SDL_CONTROLLERBUTTONDOWN, buttons);
+    SDL_EventState(SDL_CONTROLLERBUTTONUP, buttons);
+
+    const PortTable *t = table_get();
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        if (latching != latch_enabled) {
+            latch_reset(&latches[p]);
+        }
+        for (int d = 0; d < t->port[p].count; ++d) {
+            t->port[p].dev[d]->state_valid = 0;
+        }
+    }
+
+    event_inputs = enabled;
+    latching = latch_enabled;
+}
+
+void try_init(void)
+{
+    EnterCriticalSection(&critical_section);
     if (initialized) {
         dlog("Attempted initialize, but SDL is already initialized");
         LeaveCriticalSection(&critical_section);
         return;
     }
+    LeaveCriticalSection(&critical_section);
+
     dlog("Initializing");
 
+    // nothing else touches SDL before it's initialized, so the slow part
+    // runs without the lock; device detection gets its own thread, since
+    // no thread of ours is around to pump its window messages
     SDL_SetMainReady();
-    if (!SDL_Init(SDL_INIT_GAMECONTROLLER))
+    SDL_SetHint(SDL_HINT_JOYSTICK_THREAD, "1");
+
+    int64_t start = stats_now();
+    if (SDL_Init(SDL_INIT_GAMECONTROLLER))
     {
-        /* deal with the unnessessary initial controller connected
-           events so they don't clog up the log file */
-        SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
+        dlog("    SDL has failed to initialize");
+        return;
+    }
+    uint64_t init_ns = stats_since_ns(start);
 
-        int mapcount = SDL_GameControllerAddMappingsFromFile(dbpath);
-        if (mapcount == -1)
-            dlog("    Unable to load mappings from %s", dbpath);
-        else
-            dlog("    Successfully loaded %d mappings from %s", mapcount, dbpath);
+    EnterCriticalSection(&critical_section);
+
+    /* deal with the unnessessary initial controller connected
+       events so they don't clog up the log file */
+    SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
 
-        initialized = 1;
-        dlog("    ...done");
+    DeviceSettings settings = device_settings();
+    disable_unused_events();
+    set_event_inputs(settings.event_inputs, settings.latching != 0);
+    events_subscribe(EVENTS_INPUT, 1);
+
+    // mappings from the index are registered per device; fall back
+    // to loading the whole text file if there is no index
+    start = stats_now();
+    int mapcount = gcdb_open(dbpath);
+    if (mapcount != -1) {
+        for (int i = 0; i < SDL_NumJoysticks(); ++i) {
+            gcdb_register_device(i);
+        }
+    } else {
+        mapcount = SDL_GameControllerAddMappingsFromFile(dbpath);
     }
+    uint64_t mapping_ns = stats_since_ns(start);
+    if (mapcount == -1)
+        dlog("    Unable to load mappings from %s", dbpath);
     else
-        dlog("    SDL has failed to initialize");
+        dlog("    Successfully loaded %d mappings from %s", mapcount, dbpath);
+
+    initialized = 1;
+    device_start();
+    dlog("    ...done (SDL_Init %.1f ms, mappings %.1f ms)",
+        init_ns / 1e6, mapping_ns / 1e6);
 
     LeaveCriticalSection(&critical_section);
 }
 
+static DWORD WINAPI init_thread(LPVOID param)
+{
+    int64_t start = stats_now();
+    try_init();
+
+    if (initialized) {
+        int64_t open_start = stats_now();
+        con_open();
+        dlog("Input ready after %.1f ms (controller open %.1f ms)",
+            stats_since_ns(start) / 1e6, stats_since_ns(open_start) / 1e6);
+        atomic_store_explicit(&ready, 1, memory_order_release);
+        retry_reset(&init_retry);
+    } else {
+        retry_failed(&init_retry);
+        dlog("SDL init failed %u times, retrying in about %u ms",
+            atomic_load(&init_retry.failures), atomic_load(&init_retry.delay));
+    }
+
+    atomic_store(&init_running, 0);
+    return 0;
+}
+
+void init_async(void)
+{
+    int expected = 0;
+    if (atomic_load_explicit(&ready, memory_order_acquire)
+        || !retry_due(&init_retry)
+        || !atomic_compare_exchange_strong(&init_running, &expected, 1)) {
+        return;
+    }
+
+    HANDLE thread = CreateThread(NULL, 0, init_thread, NULL, 0, NULL);
+    if (thread == NULL) {
+        dlog("Unable to start initializing: CreateThread failed");
+        atomic_store(&init_running, 0);
+        return;
+    }
+    CloseHandle(thread);
+}
+
+int init_wait(void)
+{
+    retry_reset(&init_retry);
+    init_async();
+    while (atomic_load(&init_running)) {
+        Sleep(10);
+    }
+    return atomic_load_explicit(&ready, memory_order_acquire);
+}
+
 void deinit(void)
 {
+    while (atomic_load(&init_running)) {
+        Sleep(10);
+    }
+    atomic_store(&ready, 0);
+
     EnterCriticalSection(&critical_section);
     if (!initialized) {
         LeaveCriticalSection(&critical_section);
@@ -63,91 +393,528 @@ void deinit(void)
 
     dlog("Deinitializing");
 
+    LeaveCriticalSection(&critical_section);
+    device_stop_worker();
     con_close();
+    // handles are only closed once no reader holds them, and that has to
+    // happen before SDL goes away
+    epoch_synchronize();
+    EnterCriticalSection(&critical_section);
+    events_subscribe(EVENTS_INPUT, 0);
     SDL_Quit();
+    gcdb_close();
     initialized = 0;
     LeaveCriticalSection(&critical_section);
 }
 
-void con_open(void)
+static SDL_GameController *open_device(int device_index, int quiet, DeviceInfo *info, SDL_JoystickID *inst)
+{
+    SDL_GameController *c;
+    if (!SDL_IsGameController(device_index) || (c = SDL_GameControllerOpen(device_index)) == NULL) {
+        if (!quiet)
+            dlog("    Couldn't use joystick %d", device_index);
+        return NULL;
+    }
+
+    device_info_read(info, c);
+    dlog("    Found a viable controller: %s (joystick %d)", info->name, device_index);
+
+    *inst = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(c));
+    dlog("        Joystick instance ID: %d", *inst);
+    dlog("        Joystick GUID: %s", info->guid_str);
+    if (info->ident[0] != '\0')
+        dlog("        Serial/path: %s", info->ident);
+
+    if (info->mapping[0] != '\0') {
+        dlog("        Controller mapping: %s", info->mapping);
+    } else {
+        dlog("        This controller has no mapping! Closing it");
+        SDL_GameControllerClose(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+static int device_is_open(int device_index)
+{
+    SDL_JoystickID inst = SDL_JoystickGetDeviceInstanceID(device_index);
+    int port;
+    int epoch = epoch_enter();
+    int open = inst != -1 && find_device(table_get(), inst, &port) != NULL;
+    epoch_exit(epoch);
+    return open;
+}
+
+/* whether a device that isn't open yet would get a port, see port_attach */
+static int device_wanted(int device_index)
 {
+    int bound;
+    int rank = devices_rank(device_index, &bound);
+    int plugged = device_settings().plugged;
+
     EnterCriticalSection(&critical_section);
+    const PortTable *t = table_get();
+    int wanted = free_ports(t, plugged) != 0 || bound_port_open(t, plugged, bound);
+    for (int p = 0; p < PORT_COUNT && !wanted && rank != -1; ++p) {
+        wanted = rank < replaceable_rank(t, plugged, p);
+    }
+    LeaveCriticalSection(&critical_section);
 
-    dlog("Attempting to open a controller");
+    return wanted;
+}
 
-    if (!initialized) {
-        dlog("...but SDL is not initialized yet");
-        try_init();
+/* opens the given device if it's usable, else (when scanning) the best
+   ranked one that isn't in use yet and would get a port, with unknown
+   devices in index order after the known ones. no lock is held, so
+   slow HID opens don't hold up GetKeys */
+static SDL_GameController *open_preferred(int hint, int scan, int quiet, DeviceInfo *info, SDL_JoystickID *inst)
+{
+    SDL_GameController *c = NULL;
+
+    if (hint >= 0 && ((c = open_device(hint, quiet, info, inst)) != NULL || !scan)) {
+        return c;
     }
 
-    if (!initialized) {
-        dlog("Failed to open a controller: SDL not initialized");
-        LeaveCriticalSection(&critical_section);
-        return;
+    int count = SDL_NumJoysticks();
+    if (!quiet)
+        dlog("    # of joysticks: %d", count);
+
+    int order[16];
+    int rank[16];
+    int n = 0;
+    for (int i = 0; i < count && n < 16; ++i) {
+        if (i == hint || device_is_open(i) || !device_wanted(i)) {
+            continue;
+        }
+        int bound;
+        int r = devices_rank(i, &bound);
+        r = r == -1 ? DEVICES_MAX : r;
+
+        // insertion sort, stable for equal ranks
+        int j = n++;
+        for (; j > 0 && rank[j - 1] > r; --j) {
+            order[j] = order[j - 1];
+            rank[j] = rank[j - 1];
+        }
+        order[j] = i;
+        rank[j] = r;
     }
 
-    if (con != NULL) {
-        dlog("Failed to open a controller: controller is not null");
-        LeaveCriticalSection(&critical_section);
-        return;
+    for (int i = 0; i < n && c == NULL; ++i) {
+        c = open_device(order[i], quiet, info, inst);
+    }
+
+    return c;
+}
+
+static uint32_t device_present(SDL_GameController *c)
+{
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+    uint32_t present = 0;
+    for (int b = 0; b < INPUTS_BUTTON_COUNT; ++b) {
+        if (SDL_GameControllerHasButton(c, b)) {
+            present |= INPUTS_BUTTON_BIT(b);
+        }
     }
+    for (int a = 0; a < INPUTS_AXIS_COUNT; ++a) {
+        if (SDL_GameControllerHasAxis(c, a)) {
+            present |= INPUTS_AXIS_BIT(a);
+        }
+    }
+    return present;
+#else
+    (void)c;
+    return INPUTS_ALL;
+#endif
+}
 
-    dlog("    # of joysticks: %d", SDL_NumJoysticks());
+/* puts an opened controller on the port it's bound to, else on the first
+   free port or in place of a less preferred one. returns the port, or -1
+   if the handle was closed */
+static int port_attach(SDL_GameController *c, SDL_JoystickID inst, const DeviceInfo *info, int rank)
+{
+    PortDevice *old = NULL;
+    PortTable *replaced = NULL;
+    int bound = devices_get_port(info);
+    int plugged = device_settings().plugged;
+    int port = -1;
+    int merged = 0;
+    int no_memory = 0;
+    uint32_t present = device_present(c);
 
-    // open the first available controller
-    for (int i = 0; i < SDL_NumJoysticks(); ++i)
-    {
-        if (SDL_IsGameController(i) && (con = SDL_GameControllerOpen(i)) != NULL)
-        {
-            dlog("    Found a viable controller: %s (joystick %d)", SDL_GameControllerName(con), i);
+    EnterCriticalSection(&critical_section);
+    const PortTable *t = table_get();
+    int existing;
+    if (initialized && find_device(t, inst, &existing) == NULL) {
+        if (bound_port_open(t, plugged, bound)) {
+            // bound devices don't share a port with one that isn't
+            port = bound;
+            if (replaceable_rank(t, plugged, port) != -1) {
+                old = t->port[port].dev[0];
+                dlog("    Taking port %d over from %s", port + 1, old->info.name);
+            }
+        }
 
-            SDL_Joystick *joy = SDL_GameControllerGetJoystick(con);
-    
-            joy_inst = SDL_JoystickInstanceID(joy);
-            dlog("        Joystick instance ID: %d", joy_inst);
+        int mask = free_ports(t, plugged);
+        for (int p = 0; p < PORT_COUNT && port == -1; ++p) {
+            if (mask & (1 << p)) {
+                port = p;
+            }
+        }
 
-            SDL_JoystickGUID guid = SDL_JoystickGetGUID(joy);
-            char guidstr[33];
-            SDL_JoystickGetGUIDString(guid, guidstr, sizeof(guidstr));
-            dlog("        Joystick GUID: %s", guidstr);
+        if (port == -1) {
+            int worst_rank = rank;
+            for (int p = 0; p < PORT_COUNT; ++p) {
+                int r = replaceable_rank(t, plugged, p);
+                if (r > worst_rank) {
+                    port = p;
+                    worst_rank = r;
+                }
+            }
+            if (port != -1) {
+                old = t->port[port].dev[0];
+                dlog("    Switching over from the less preferred %s", old->info.name);
+            }
+        }
 
-            char *mapping = SDL_GameControllerMapping(con);
-            if (mapping != NULL) {
-                dlog("        Controller mapping: %s", mapping);
-                SDL_free(mapping);
-            } else {
-                dlog("        This controller has no mapping! Closing it");
-                // skip this controller
-                con_close();
-                continue;
+        PortDevice *d = NULL;
+        PortTable *next = NULL;
+        if (port != -1) {
+            d = malloc(sizeof(*d));
+            next = d != NULL ? table_copy() : NULL;
+            if (next == NULL) {
+                free(d);
+                old = NULL;
+                port = -1;
+                no_memory = 1;
+            }
+        }
+
+        if (port != -1) {
+            d->con = c;
+            d->joy_inst = inst;
+            d->info = *info;
+            d->present = present;
+            d->state = (inputs_t){0};
+            d->state_valid = 0;
+
+            Port *pt = &next->port[port];
+            if (old != NULL) {
+                pt->count = 0;
+            }
+            if (pt->count == 0) {
+                latch_reset(&latches[port]);
             }
+            merged = pt->count > 0;
+            pt->dev[pt->count++] = d;
+            replaced = table_publish(next);
+        }
+    }
+    LeaveCriticalSection(&critical_section);
+
+    table_retire(replaced);
+    if (old != NULL) {
+        epoch_retire(old, device_destroy);
+    }
+    if (no_memory) {
+        dlog("    Out of memory, closing it");
+        SDL_GameControllerClose(c);
+    } else if (port == -1) {
+        dlog("    No free controller port for it, closing it");
+        SDL_GameControllerClose(c);
+    } else if (merged) {
+        dlog("    Merging it into controller %d", port + 1);
+    } else {
+        dlog("    Using it for controller %d", port + 1);
+    }
+    return port;
+}
+
+static void con_open_device(int device_index)
+{
+    // added devices show up as both joystick and controller events
+    if (device_index >= 0 && device_is_open(device_index)) {
+        device_index = -1;
+    }
+
+    EnterCriticalSection(&critical_section);
+
+    // background retries only log what they find
+    int quiet = atomic_load(&open_retry.failures) > 0;
+    if (!quiet)
+        dlog("Attempting to open a controller");
+
+    if (!initialized) {
+        // the init thread opens one once it's done
+        dlog("...but SDL is not initialized yet");
+        LeaveCriticalSection(&critical_section);
+        init_async();
+        return;
+    }
 
+    int free = free_ports(table_get(), device_settings().plugged);
+    LeaveCriticalSection(&critical_section);
+
+    // when scanning, every device that gets a port: one for each free
+    // port, plus those bound to a port
+    int attached = 0;
+    int scan = device_index < 0 || free != 0;
+    for (;;) {
+        DeviceInfo info;
+        SDL_JoystickID inst = -1;
+        SDL_GameController *c = open_preferred(device_index, scan, quiet, &info, &inst);
+        if (c == NULL) {
             break;
         }
-        else
-            dlog("    Couldn't use joystick %d", i);
+
+        int rank = devices_add(&info);
+        if (port_attach(c, inst, &info, rank) == -1) {
+            break;
+        }
+        ++attached;
+        device_index = -1;
+        scan = 1;
     }
 
-    if (con == NULL)
+    int plugged = device_settings().plugged;
+    EnterCriticalSection(&critical_section);
+    free = free_ports(table_get(), plugged);
+    LeaveCriticalSection(&critical_section);
+
+    if (attached == 0 && free != 0 && !quiet)
         dlog("    Couldn't find a viable controller :(");
-    
+
+    // keep looking in the background while plugged ports are empty
+    if (free != 0) {
+        retry_failed(&open_retry);
+    } else {
+        retry_reset(&open_retry);
+    }
+}
+
+void con_open(void)
+{
+    con_open_device(-1);
+}
+
+/* takes a controller out of use. its handle is closed once no reader
+   can be using it any more, by the device worker if there is one.
+   returns 0 if it's still in use because a new table couldn't be made */
+static int con_detach(SDL_JoystickID inst)
+{
+    PortDevice *d = NULL;
+    PortTable *replaced = NULL;
+    int detached = 1;
+    int port;
+
+    EnterCriticalSection(&critical_section);
+    PortTable *t = NULL;
+    if (find_device(table_get(), inst, &port) != NULL) {
+        t = table_copy();
+        detached = t != NULL;
+    }
+    if (t != NULL) {
+        Port *pt = &t->port[port];
+        for (int i = 0; i < pt->count; ++i) {
+            if (pt->dev[i]->joy_inst == inst) {
+                d = pt->dev[i];
+                pt->dev[i] = pt->dev[--pt->count];
+                break;
+            }
+        }
+        if (pt->count == 0) {
+            latch_reset(&latches[port]);
+        }
+        replaced = table_publish(t);
+    }
     LeaveCriticalSection(&critical_section);
+
+    table_retire(replaced);
+    if (d != NULL) {
+        epoch_retire(d, device_destroy);
+    }
+    if (!detached) {
+        dlog("Out of memory, keeping the controller on port %d", port + 1);
+    }
+    return detached;
 }
 
+/* detaching retires outside critical_section, so the devices are looked
+   up as a reader instead of with the lock held */
 void con_close(void)
 {
-    EnterCriticalSection(&critical_section);
-    if (!initialized && con != NULL) con = NULL;
-    if (!initialized || con == NULL) {
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        for (;;) {
+            int epoch = epoch_enter();
+            const Port *pt = &table_get()->port[p];
+            int any = pt->count > 0;
+            SDL_JoystickID inst = any ? pt->dev[0]->joy_inst : 0;
+            epoch_exit(epoch);
+
+            if (!any) {
+                break;
+            }
+            dlog("Closing a controller on port %d", p + 1);
+            if (!con_detach(inst)) {
+                break;
+            }
+        }
+    }
+}
+
+static DWORD WINAPI device_worker(LPVOID param)
+{
+    while (WaitForSingleObject(device_event, INFINITE) == WAIT_OBJECT_0
+           && !atomic_load(&device_stop)) {
+        // closes first, so a reconnecting device has its old handle freed
+        EnterCriticalSection(&critical_section);
+        SDL_GameController *closing[DEVICE_CLOSE_MAX];
+        int count = close_count;
+        memcpy(closing, close_queue, sizeof(closing[0]) * count);
+        close_count = 0;
         LeaveCriticalSection(&critical_section);
+
+        for (int i = 0; i < count; ++i) {
+            dlog("Closing a controller that's no longer in use");
+            SDL_GameControllerClose(closing[i]);
+        }
+
+        if (atomic_exchange(&open_requested, 0)) {
+            con_open_device(atomic_exchange(&open_hint, -1));
+        }
+    }
+    return 0;
+}
+
+static void device_start(void)
+{
+    atomic_store(&device_stop, 0);
+    device_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (device_event == NULL) {
+        return;
+    }
+    device_thread = CreateThread(NULL, 0, device_worker, NULL, 0, NULL);
+    if (device_thread == NULL) {
+        dlog("Unable to start the device worker, opening controllers inline");
+        CloseHandle(device_event);
+        device_event = NULL;
+    }
+}
+
+static void device_stop_worker(void)
+{
+    if (device_thread == NULL) {
+        return;
+    }
+
+    atomic_store(&device_stop, 1);
+    SetEvent(device_event);
+    WaitForSingleObject(device_thread, INFINITE);
+    CloseHandle(device_thread);
+
+    // retired devices are closed inline from here on
+    EnterCriticalSection(&critical_section);
+    CloseHandle(device_event);
+    device_thread = NULL;
+    device_event = NULL;
+    SDL_GameController *closing[DEVICE_CLOSE_MAX];
+    int count = close_count;
+    memcpy(closing, close_queue, sizeof(closing[0]) * count);
+    close_count = 0;
+    LeaveCriticalSection(&critical_section);
+
+    atomic_store(&open_requested, 0);
+    for (int i = 0; i < count; ++i) {
+        SDL_GameControllerClose(closing[i]);
+    }
+}
+
+static void con_open_device_async(int device_index)
+{
+    if (device_thread == NULL) {
+        con_open_device(device_index);
+        return;
+    }
+    atomic_store(&open_hint, device_index);
+    if (!atomic_exchange(&open_requested, 1)) {
+        SetEvent(device_event);
+    }
+}
+
+void con_open_async(void)
+{
+    con_open_device_async(-1);
+}
+
+/* a device was added: open it if it gets a port, which for a known device
+   is matched by GUID */
+static void device_added(int device_index)
+{
+    if (!SDL_IsGameController(device_index)) {
         return;
     }
 
-    dlog("Closing current controller");
-    SDL_GameControllerClose(con);
-    con = NULL;
-    joy_inst = -1;
+    if (!device_wanted(device_index)) {
+        dlog("    ...but all plugged controller ports are in use");
+        return;
+    }
+
+    retry_reset(&open_retry);
+    con_open_device_async(device_index);
+}
+
+void con_prefer(int port, int dev)
+{
+    EnterCriticalSection(&critical_section);
+    const Port *pt = &table_get()->port[port];
+    if (dev < pt->count) {
+        devices_prefer(&pt->dev[dev]->info);
+        dlog("%s is now the preferred controller", pt->dev[dev]->info.name);
+    }
+    LeaveCriticalSection(&critical_section);
+}
+
+/* binds a device to a port (-1 for any); one bound elsewhere is moved */
+void con_bind(int port, int dev, int bound)
+{
+    SDL_JoystickID move = -1;
+
+    EnterCriticalSection(&critical_section);
+    const Port *pt = &table_get()->port[port];
+    if (dev < pt->count) {
+        const PortDevice *d = pt->dev[dev];
+        devices_set_port(&d->info, bound);
+        if (bound != -1) {
+            dlog("%s is now bound to controller %d", d->info.name, bound + 1);
+        } else {
+            dlog("%s is no longer bound to a controller", d->info.name);
+        }
+        if (bound != -1 && bound != port) {
+            move = d->joy_inst;
+        }
+    }
     LeaveCriticalSection(&critical_section);
+
+    if (move != -1) {
+        con_detach(move);
+        retry_reset(&open_retry);
+        con_open_async();
+    }
+}
+
+int con_get_info(int port, int dev, DeviceInfo *info, int *rank, int *bound)
+{
+    EnterCriticalSection(&critical_section);
+    const Port *pt = &table_get()->port[port];
+    int active = dev < pt->count;
+    if (active) {
+        *info = pt->dev[dev]->info;
+        *rank = devices_find(info);
+        *bound = devices_get_port(info);
+    }
+    LeaveCriticalSection(&critical_section);
+    return active;
 }
 
 int16_t threshold(int16_t val, float cutoff)
@@ -219,107 +986,293 @@ int16_t smax(int16_t val, int16_t max)
     return val;
 }
 
-void con_get_inputs(inputs_t *i)
+/* after input events were dropped: poll the state again, and look for
+   devices that came or went meanwhile */
+static void con_resync(void)
 {
-    EnterCriticalSection(&critical_section);
-    if (!initialized)
-    {
-        dlog("Attempting to get inputs but SDL is not initialized");
-        try_init();
-        if (!initialized) {
-            LeaveCriticalSection(&critical_section);
-            return;
+    dlog("Input events were dropped, checking controllers again");
+
+    SDL_JoystickID gone[PORT_COUNT * PORT_DEVICES_MAX];
+    int count = 0;
+
+    int epoch = epoch_enter();
+    const PortTable *t = table_get();
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        for (int d = 0; d < t->port[p].count; ++d) {
+            PortDevice *dev = t->port[p].dev[d];
+            dev->state_valid = 0;
+            if (!SDL_GameControllerGetAttached(dev->con)) {
+                gone[count++] = dev->joy_inst;
+            }
         }
     }
-    LeaveCriticalSection(&critical_section);
+    epoch_exit(epoch);
+
+    for (int i = 0; i < count; ++i) {
+        con_detach(gone[i]);
+    }
+    retry_reset(&open_retry);
+    con_open_async();
+}
+
+static int con_write_inputs(const Port *pt, inputs_t *i, uint32_t need);
+
+/* reads every port with a controller in one pass, returns them as a mask,
+   with the input generation of each. need is the inputs_t fields each
+   port's mapping reads, see INPUTS_ALL; the others may read as zero.
+   the port table is pinned rather than locked, so hotplug and the config
+   window never hold this up; devices removed meanwhile stay open until
+   the pass is over */
+int con_get_inputs(inputs_t i[PORT_COUNT], unsigned int gen[PORT_COUNT], const uint32_t need[PORT_COUNT])
+{
+    if (!atomic_load_explicit(&ready, memory_order_acquire)) {
+        init_async();
+        return 0;
+    }
+
+    int epoch = epoch_enter();
+    const PortTable *t = table_get();
+
+    // without any controller there's nothing to read; only look for
+    // controllers when the next retry is due, or right away when a
+    // device event came in. with no controller open, those are the only
+    // events that reach the input queue
+    int active = 0;
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        active |= t->port[p].count;
+    }
+    if (!active && !retry_due(&open_retry)) {
+        events_pump();
+        if (!events_pending(EVENTS_INPUT)) {
+            epoch_exit(epoch);
+            return 0;
+        }
+        retry_reset(&open_retry);
+    }
+
+    DeviceSettings settings = device_settings();
+    int latch_enabled = settings.latching != 0;
+    if (settings.event_inputs != event_inputs || latch_enabled != latching) {
+        EnterCriticalSection(&critical_section);
+        set_event_inputs(settings.event_inputs, latch_enabled);
+        LeaveCriticalSection(&critical_section);
+    }
 
     SDL_Event e;
-    while (SDL_PollEvent(&e))
+    PortDevice *d;
+    int port;
+    int64_t poll_start = stats_now();
+    uint64_t poll_ns = 0;
+    events_pump();
+    if (events_dropped(EVENTS_INPUT)) {
+        con_resync();
+    }
+    while (events_next(EVENTS_INPUT, &e)) {
+        poll_ns += stats_since_ns(poll_start);
+        // handling an event may have replaced the table
+        t = table_get();
         switch (e.type)
         {
+        case SDL_CONTROLLERBUTTONDOWN:
+        case SDL_CONTROLLERBUTTONUP:
+            if ((d = find_device(t, e.cbutton.which, &port)) != NULL && e.cbutton.button < INPUTS_BUTTON_COUNT) {
+                uint16_t bit = 1 << e.cbutton.button;
+                atomic_store_explicit(&event_time, e.cbutton.timestamp, memory_order_relaxed);
+                if (e.cbutton.state) {
+                    d->state.buttons |= bit;
+                } else {
+                    d->state.buttons &= ~bit;
+                }
+                ++input_gen[port];
+                if (latching) {
+                    stats_enter(&critical_section);
+                    if (e.cbutton.state) {
+                        latch_press(&latches[port], e.cbutton.button, e.cbutton.timestamp);
+                    } else {
+                        latch_release(&latches[port], e.cbutton.button, e.cbutton.timestamp);
+                    }
+                    LeaveCriticalSection(&critical_section);
+                }
+            }
+            break;
+        case SDL_CONTROLLERAXISMOTION:
+            // bursts of motion events coalesce, only the latest value is kept
+            if ((d = find_device(t, e.caxis.which, &port)) != NULL && e.caxis.axis < INPUTS_AXIS_COUNT) {
+                atomic_store_explicit(&event_time, e.caxis.timestamp, memory_order_relaxed);
+                d->state.axes[e.caxis.axis] = sclamp(e.caxis.value, -32767, 32767);
+                ++input_gen[port];
+            }
+            break;
+        case SDL_CONTROLLERDEVICEREMAPPED:
+            if ((d = find_device(t, e.cdevice.which, &port)) != NULL) {
+                dlog("A controller on port %d has been remapped", port + 1);
+                char *mapping = SDL_GameControllerMapping(d->con);
+                EnterCriticalSection(&critical_section);
+                snprintf(d->info.mapping, sizeof(d->info.mapping),
+                    "%s", mapping != NULL ? mapping : "");
+                LeaveCriticalSection(&critical_section);
+                d->state_valid = 0;
+                SDL_free(mapping);
+            }
+            break;
+        case SDL_JOYDEVICEADDED:
+            // SDL only reports controllers it has a mapping for, so give it
+            // the one from the index before it decides
+            if (gcdb_register_device(e.jdevice.which)) {
+                dlog("A device with a gamecontrollerdb mapping has been added");
+                device_added(e.jdevice.which);
+            }
+            break;
         case SDL_CONTROLLERDEVICEADDED:
             dlog("A device has been added");
-            if (con == NULL)
-            {
-                dlog("    ...and there is no active controller");
-                con_open();
-            }
-            else
-                dlog("    ...but there is already an active controller");
+            device_added(e.cdevice.which);
             break;
         case SDL_CONTROLLERDEVICEREMOVED:
             dlog("A device has been removed");
-            if (e.cdevice.which == joy_inst)
+            if (find_device(t, e.cdevice.which, &port) != NULL)
             {
-                dlog("    ...it was the active controller");
-                con_close();
-                con_open();
+                dlog("    ...it was on port %d", port + 1);
+                con_detach(e.cdevice.which);
+                retry_reset(&open_retry);
+                con_open_async();
             }
             else
-                dlog("    ...it was not the active controller");
+                dlog("    ...it was not an active controller");
             break;
         }
+        poll_start = stats_now();
+    }
+    poll_ns += stats_since_ns(poll_start);
+    stats_record(STAT_POLL_EVENT, poll_ns);
 
-    EnterCriticalSection(&critical_section);
-    if (con != NULL)
-        con_write_inputs(i);
-    LeaveCriticalSection(&critical_section);
+    int mask = 0;
+    t = table_get();
+    int searching = free_ports(t, settings.plugged) != 0;
+    if (t->version != table_seen) {
+        // devices came or went
+        table_seen = t->version;
+        for (int p = 0; p < PORT_COUNT; ++p) {
+            ++input_gen[p];
+        }
+    }
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        if (t->port[p].count > 0) {
+            // event states only change with events, which counted already
+            if (con_write_inputs(&t->port[p], &i[p], need[p])
+                && memcmp(&i[p], &input_last[p], sizeof(i[p])) != 0) {
+                ++input_gen[p];
+            }
+            input_last[p] = i[p];
+            gen[p] = input_gen[p];
+            mask |= 1 << p;
+        }
+    }
+    epoch_exit(epoch);
+
+    if (searching && retry_due(&open_retry)) {
+        con_open_async();
+    }
+
+    return mask;
 }
 
-static inline uint8_t con_get_but(SDL_GameControllerButton b)
+static inline uint8_t con_get_but(SDL_GameController *c, SDL_GameControllerButton b)
 {
-    return SDL_GameControllerGetButton(con, b);
+    return SDL_GameControllerGetButton(c, b);
 }
 
-static inline int16_t con_get_axis(SDL_GameControllerAxis a)
+static inline int16_t con_get_axis(SDL_GameController *c, SDL_GameControllerAxis a)
 {
-    return sclamp(SDL_GameControllerGetAxis(con, a), -32767, 32767);
+    return sclamp(SDL_GameControllerGetAxis(c, a), -32767, 32767);
+}
+
+/* fetches the fields in mask, the rest read as released or centered */
+static void con_poll_inputs(SDL_GameController *c, inputs_t *i, uint32_t mask)
+{
+    *i = (inputs_t){0};
+    for (int b = 0; b < INPUTS_BUTTON_COUNT; ++b) {
+        if (mask & INPUTS_BUTTON_BIT(b) && con_get_but(c, b)) {
+            i->buttons |= 1 << b;
+        }
+    }
+    for (int a = 0; a < INPUTS_AXIS_COUNT; ++a) {
+        if (mask & INPUTS_AXIS_BIT(a)) {
+            i->axes[a] = con_get_axis(c, a);
+        }
+    }
 }
 
-void con_write_inputs(inputs_t *i)
+/* returns whether the device was polled */
+static int con_read_device(PortDevice *d, inputs_t *i, uint32_t need)
 {
-    i->a      = con_get_but(SDL_CONTROLLER_BUTTON_A);
-    i->b      = con_get_but(SDL_CONTROLLER_BUTTON_B);
-    i->x      = con_get_but(SDL_CONTROLLER_BUTTON_X);
-    i->y      = con_get_but(SDL_CONTROLLER_BUTTON_Y);
-    i->back   = con_get_but(SDL_CONTROLLER_BUTTON_BACK);
-    i->guide  = con_get_but(SDL_CONTROLLER_BUTTON_GUIDE);
-    i->start  = con_get_but(SDL_CONTROLLER_BUTTON_START);
-    i->lstick = con_get_but(SDL_CONTROLLER_BUTTON_LEFTSTICK);
-    i->rstick = con_get_but(SDL_CONTROLLER_BUTTON_RIGHTSTICK);
-    i->lshoul = con_get_but(SDL_CONTROLLER_BUTTON_LEFTSHOULDER);
-    i->rshoul = con_get_but(SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);
-    i->dup    = con_get_but(SDL_CONTROLLER_BUTTON_DPAD_UP);
-    i->ddown  = con_get_but(SDL_CONTROLLER_BUTTON_DPAD_DOWN);
-    i->dleft  = con_get_but(SDL_CONTROLLER_BUTTON_DPAD_LEFT);
-    i->dright = con_get_but(SDL_CONTROLLER_BUTTON_DPAD_RIGHT);
+    if (!event_inputs) {
+        con_poll_inputs(d->con, i, need & d->present);
+        return 1;
+    }
 
-    i->alx    = con_get_axis(SDL_CONTROLLER_AXIS_LEFTX);
-    i->aly    = con_get_axis(SDL_CONTROLLER_AXIS_LEFTY);
-    i->arx    = con_get_axis(SDL_CONTROLLER_AXIS_RIGHTX);
-    i->ary    = con_get_axis(SDL_CONTROLLER_AXIS_RIGHTY);
-    i->altrig = con_get_axis(SDL_CONTROLLER_AXIS_TRIGGERLEFT);
-    i->artrig = con_get_axis(SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
+    // events keep every field current, so the reseed does too; otherwise
+    // a field the mapping starts reading later would be stale
+    int polled = !d->state_valid;
+    if (polled) {
+        con_poll_inputs(d->con, &d->state, d->present);
+        d->state_valid = 1;
+    }
+    *i = d->state;
+    return polled;
 }
 
-void dlog(const char *fmt, ...)
+/* reads the devices on a port, merged into one state; returns whether
+   any of them was polled */
+static int con_write_inputs(const Port *pt, inputs_t *i, uint32_t need)
 {
-    time_t rawtime;
-    time(&rawtime);
-    struct tm *timeinfo = localtime(&rawtime);
-    char buf[1024];
+    int polled = con_read_device(pt->dev[0], i, need);
+    for (int d = 1; d < pt->count; ++d) {
+        inputs_t in;
+        polled |= con_read_device(pt->dev[d], &in, need);
+        inputs_merge(i, &in);
+    }
+    return polled;
+}
+
+/* the latch is shared with the event handling, so this locks, but only
+   on ports that latch */
+void con_latch_inputs(const ControllerConfig *cfg, int port, inputs_t *i, int new_frame)
+{
+    if (!cfg->latching) {
+        return;
+    }
 
-    char timestr[9];
-    strftime(timestr, sizeof(timestr), "%X", timeinfo);
+    stats_enter(&critical_section);
+    if (latching) {
+        i->buttons = latch_apply(&latches[port], i->buttons, cfg->latch_frames, new_frame);
+    }
+    LeaveCriticalSection(&critical_section);
+}
 
-    fprintf(logfile, "[%s] ", timestr);
+void con_record_event_age(void)
+{
+    uint32_t t = atomic_exchange_explicit(&event_time, 0, memory_order_relaxed);
+    if (t != 0) {
+        stats_record(STAT_EVENT_AGE, (uint64_t)(SDL_GetTicks() - t) * 1000000);
+    }
+}
 
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    write_log(buf);
-    va_end(args);
+/* summed over all ports */
+void con_latch_stats(unsigned int *presses, unsigned int *saved, uint32_t *shortest_tap)
+{
+    *presses = 0;
+    *saved = 0;
+    *shortest_tap = 0;
 
-    fprintf(logfile, "\n");
+    // the input path updates the counters under the same lock
+    EnterCriticalSection(&critical_section);
+    for (int p = 0; p < PORT_COUNT; ++p) {
+        const LatchState *l = &latches[p];
+        *presses += l->presses;
+        *saved += l->saved;
+        if (l->saved > 0 && (*shortest_tap == 0 || l->shortest_tap < *shortest_tap)) {
+            *shortest_tap = l->shortest_tap;
+        }
+    }
+    LeaveCriticalSection(&critical_section);
 }
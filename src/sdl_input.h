@@ -11,12 +11,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <limits.h>
+#include "devices.h"
+#include "config.h"
 
 extern CRITICAL_SECTION critical_section; 
 
-extern FILE *logfile;
 extern char dbpath[PATH_MAX];
-extern SDL_GameController *con;
 extern int initialized;
 
 #define STRINGIFY(x) #x
@@ -35,49 +35,88 @@ extern int initialized;
     "\n\nLicensed under the Mozilla Public License 2.0" \
     "\n(http://mozilla.org/MPL/2.0/)"
 
-typedef struct
-{
-    uint16_t a       : 1;
-    uint16_t b       : 1;
-    uint16_t x       : 1;
-    uint16_t y       : 1;
-
-    uint16_t back    : 1;
-    uint16_t guide   : 1;
-    uint16_t start   : 1;
-
-    uint16_t lstick  : 1;
-    uint16_t rstick  : 1;
-    uint16_t lshoul  : 1;
-    uint16_t rshoul  : 1;
-
-    uint16_t dup     : 1;
-    uint16_t ddown   : 1;
-    uint16_t dleft   : 1;
-    uint16_t dright  : 1;
+#define INPUTS_BUTTON_COUNT (SDL_CONTROLLER_BUTTON_DPAD_RIGHT + 1)
+#define INPUTS_AXIS_COUNT   SDL_CONTROLLER_AXIS_MAX
 
-    int16_t alx;
-    int16_t aly;
+/* fields of inputs_t as a bitmask, buttons first, then axes */
+#define INPUTS_BUTTON_BIT(b) (1u << (b))
+#define INPUTS_AXIS_BIT(a)   (1u << (INPUTS_BUTTON_COUNT + (a)))
+#define INPUTS_ALL           ((1u << (INPUTS_BUTTON_COUNT + INPUTS_AXIS_COUNT)) - 1)
 
-    int16_t arx;
-    int16_t ary;
-
-    int16_t altrig;
-    int16_t artrig;
+/* buttons and axes are laid out in SDL_GameControllerButton and
+   SDL_GameControllerAxis order so they can also be accessed packed */
+typedef struct
+{
+    union {
+        struct {
+            uint16_t a       : 1;
+            uint16_t b       : 1;
+            uint16_t x       : 1;
+            uint16_t y       : 1;
+
+            uint16_t back    : 1;
+            uint16_t guide   : 1;
+            uint16_t start   : 1;
+
+            uint16_t lstick  : 1;
+            uint16_t rstick  : 1;
+            uint16_t lshoul  : 1;
+            uint16_t rshoul  : 1;
+
+            uint16_t dup     : 1;
+            uint16_t ddown   : 1;
+            uint16_t dleft   : 1;
+            uint16_t dright  : 1;
+        };
+        uint16_t buttons;
+    };
+
+    union {
+        struct {
+            int16_t alx;
+            int16_t aly;
+
+            int16_t arx;
+            int16_t ary;
+
+            int16_t altrig;
+            int16_t artrig;
+        };
+        int16_t axes[INPUTS_AXIS_COUNT];
+    };
 } inputs_t;
 
+/* combines the inputs of two devices on one port: buttons are ORed and
+   axes added with saturation, a fixed amount of work on the packed state */
+static inline void inputs_merge(inputs_t *acc, const inputs_t *in)
+{
+    acc->buttons |= in->buttons;
+    for (int a = 0; a < INPUTS_AXIS_COUNT; ++a) {
+        int32_t v = (int32_t)acc->axes[a] + in->axes[a];
+        acc->axes[a] = v > 32767 ? 32767 : v < -32767 ? -32767 : v;
+    }
+}
+
 void try_init(void);
+void init_async(void);
+int init_wait(void);
 void deinit(void);
 void con_open(void);
+void con_open_async(void);
 void con_close(void);
+void con_prefer(int port, int dev);
+void con_bind(int port, int dev, int bound);
+int con_get_info(int port, int dev, DeviceInfo *info, int *rank, int *bound);
 int16_t threshold(int16_t val, float cutoff);
 void scale_and_limit(int16_t *x, int16_t *y, float dz, float edge);
 int16_t sclamp(int16_t val, int16_t min, int16_t max);
 int16_t smin(int16_t val, int16_t min);
 int16_t smax(int16_t val, int16_t max);
-void con_get_inputs(inputs_t *i);
+int con_get_inputs(inputs_t i[PORT_COUNT], unsigned int gen[PORT_COUNT], const uint32_t need[PORT_COUNT]);
 
-void con_write_inputs(inputs_t *i);
+void con_latch_inputs(const ControllerConfig *cfg, int port, inputs_t *i, int new_frame);
+void con_record_event_age(void);
+void con_latch_stats(unsigned int *presses, unsigned int *saved, uint32_t *shortest_tap);
 void dlog(const char *fmt, ...);
 
 #endif
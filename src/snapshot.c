@@ -0,0 +1,73 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "epoch.h"
+
+/* all zeroes until the config is first loaded: no ports plugged */
+static ConfigSnapshot initial;
+static ConfigSnapshot *_Atomic current = &initial;
+
+static void snapshot_destroy(void *p)
+{
+    ConfigSnapshot *snap = p;
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        mapping_release(&snap->prog[port]);
+    }
+    free(snap);
+}
+
+/* only called from one thread at a time: DllMain, then the config window */
+void snapshot_publish(const ControllerConfig con[PORT_COUNT], const PluginConfig *plugin)
+{
+    const ConfigSnapshot *prev = atomic_load_explicit(&current, memory_order_relaxed);
+    ConfigSnapshot *snap = malloc(sizeof(*snap));
+    if (snap == NULL) {
+        dlog("Unable to apply the settings: out of memory");
+        return;
+    }
+
+    snap->version = prev->version + 1;
+    memcpy(snap->con, con, sizeof(snap->con));
+    snap->plugin = *plugin;
+
+    // programs start as a copy of the previous ones, sharing their gate
+    // tables; one is only rebuilt when the notches change, so publishing
+    // every step of a slider drag doesn't copy or build tables
+    int compiled = 1;
+    for (int port = 0; port < PORT_COUNT; ++port) {
+        mapping_share(&snap->prog[port], &prev->prog[port]);
+        if (prev == &initial || memcmp(&prev->con[port], &con[port], sizeof(con[port]))) {
+            compiled &= mapping_compile(&snap->prog[port], &con[port]);
+        }
+    }
+    if (!compiled) {
+        dlog("Unable to apply the settings: out of memory");
+        snapshot_destroy(snap);
+        return;
+    }
+
+    ConfigSnapshot *old = atomic_exchange(&current, snap);
+    if (old != &initial) {
+        epoch_retire(old, snapshot_destroy);
+    }
+}
+
+const ConfigSnapshot *snapshot_get(void)
+{
+    return atomic_load_explicit(&current, memory_order_acquire);
+}
+
+/* at unload, once nothing reads any more */
+void snapshot_free(void)
+{
+    ConfigSnapshot *old = atomic_exchange(&current, &initial);
+    if (old != &initial) {
+        epoch_retire(old, snapshot_destroy);
+    }
+    epoch_reclaim();
+}
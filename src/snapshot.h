@@ -0,0 +1,30 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_SNAPSHOT_H_
+#define OCTOMINO_SNAPSHOT_H_
+
+#include "config.h"
+#include "mapping.h"
+
+/* The settings the input path works with. concfg and plugcfg are only
+   edited by the config window and the config file code; config_changed()
+   publishes a copy of them, with the mappings compiled, as a new
+   snapshot. A published snapshot is never modified, so a reader sees
+   either all of an edit or none of it. Readers load the current one
+   with snapshot_get() between epoch_enter() and epoch_exit(). */
+
+typedef struct ConfigSnapshot
+{
+    unsigned int version;   // goes up with every publish
+    ControllerConfig con[PORT_COUNT];
+    PluginConfig plugin;
+    MappingProgram prog[PORT_COUNT];
+} ConfigSnapshot;
+
+void snapshot_publish(const ControllerConfig con[PORT_COUNT], const PluginConfig *plugin);
+const ConfigSnapshot *snapshot_get(void);
+void snapshot_free(void);
+
+#endif
@@ -0,0 +1,182 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include "stats.h"
+#include "sdl_input.h"
+
+// bucket 0 holds 0 ns, bucket k holds [2^(k-1), 2^k) ns, the last one the rest
+#define STATS_BUCKETS 36
+
+typedef struct Histogram
+{
+    atomic_uint buckets[STATS_BUCKETS];
+    _Atomic uint64_t max;
+} Histogram;
+
+static Histogram hist[STAT_COUNT];
+static int64_t qpc_freq;
+
+static atomic_uint cache_hits;
+static atomic_uint cache_misses;
+
+static const char *stat_names[STAT_COUNT] = {
+    "Event age",
+    "Event pump",
+    "Lock wait",
+    "GetKeys",
+};
+
+void stats_init(void)
+{
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    qpc_freq = f.QuadPart;
+}
+
+void stats_reset(void)
+{
+    for (int i = 0; i < STAT_COUNT; ++i) {
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            atomic_store_explicit(&hist[i].buckets[b], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&hist[i].max, 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&cache_hits, 0, memory_order_relaxed);
+    atomic_store_explicit(&cache_misses, 0, memory_order_relaxed);
+}
+
+static int bucket_of(uint64_t ns)
+{
+    int b = 0;
+    while (ns != 0 && b < STATS_BUCKETS - 1) {
+        ns >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+void stats_record(StatId id, uint64_t ns)
+{
+    Histogram *h = &hist[id];
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(
+            &h->max, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t stats_since_ns(int64_t start)
+{
+    int64_t ticks = stats_now() - start;
+    if (ticks < 0 || qpc_freq == 0) {
+        ticks = 0;
+    }
+    // split to keep the multiplication in range for long waits
+    return (uint64_t)(ticks / qpc_freq) * 1000000000
+         + (uint64_t)(ticks % qpc_freq) * 1000000000 / qpc_freq;
+}
+
+static uint64_t bucket_bound(int b)
+{
+    return b == 0 ? 0 : (uint64_t)1 << b;
+}
+
+void stats_summary(StatId id, StatSummary *s)
+{
+    uint32_t counts[STATS_BUCKETS];
+    uint32_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; ++b) {
+        counts[b] = atomic_load_explicit(&hist[id].buckets[b], memory_order_relaxed);
+        total += counts[b];
+    }
+
+    s->count = total;
+    s->max = atomic_load_explicit(&hist[id].max, memory_order_relaxed);
+    s->p50 = 0;
+    s->p99 = 0;
+
+    // percentiles are the upper bounds of the buckets they fall in
+    uint64_t seen = 0;
+    int have_p50 = 0;
+    for (int b = 0; b < STATS_BUCKETS && total > 0; ++b) {
+        seen += counts[b];
+        if (!have_p50 && seen * 100 >= (uint64_t)total * 50) {
+            s->p50 = bucket_bound(b);
+            have_p50 = 1;
+        }
+        if (seen * 100 >= (uint64_t)total * 99) {
+            s->p99 = bucket_bound(b);
+            break;
+        }
+    }
+    if (s->p50 > s->max) {
+        s->p50 = s->max;
+    }
+    if (s->p99 > s->max) {
+        s->p99 = s->max;
+    }
+}
+
+const char *stats_name(StatId id)
+{
+    return stat_names[id];
+}
+
+static const char *format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000) {
+        snprintf(buf, size, "%u ns", (unsigned int)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1f us", ns / 1000.0);
+    } else {
+        snprintf(buf, size, "%.2f ms", ns / 1000000.0);
+    }
+    return buf;
+}
+
+void stats_format(StatId id, char *buf, size_t size)
+{
+    StatSummary s;
+    stats_summary(id, &s);
+    if (s.count == 0) {
+        snprintf(buf, size, "no samples");
+        return;
+    }
+
+    char p50[16], p99[16], max[16];
+    snprintf(buf, size, "p50 %s, p99 %s, max %s (%u)",
+        format_ns(p50, sizeof(p50), s.p50),
+        format_ns(p99, sizeof(p99), s.p99),
+        format_ns(max, sizeof(max), s.max),
+        s.count);
+}
+
+void stats_cache(int hit)
+{
+    atomic_fetch_add_explicit(hit ? &cache_hits : &cache_misses, 1, memory_order_relaxed);
+}
+
+void stats_cache_format(char *buf, size_t size)
+{
+    unsigned int hits = atomic_load_explicit(&cache_hits, memory_order_relaxed);
+    unsigned int total = hits + atomic_load_explicit(&cache_misses, memory_order_relaxed);
+    if (total == 0) {
+        snprintf(buf, size, "no samples");
+        return;
+    }
+    snprintf(buf, size, "%.1f%% reused (%u of %u)", hits * 100.0 / total, hits, total);
+}
+
+void stats_dump(void)
+{
+    char buf[128];
+    for (int i = 0; i < STAT_COUNT; ++i) {
+        stats_format(i, buf, sizeof(buf));
+        dlog("%-14s %s", stats_name(i), buf);
+    }
+    stats_cache_format(buf, sizeof(buf));
+    dlog("%-14s %s", "Mapping cache", buf);
+}
@@ -0,0 +1,74 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef OCTOMINO_STATS_H_
+#define OCTOMINO_STATS_H_
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Always-on latency histograms for the GetKeys path. Each stat counts
+   nanosecond durations in log2 buckets, so recording is a couple of
+   relaxed atomic adds and percentiles are reported as bucket bounds. */
+
+typedef enum StatId
+{
+    STAT_EVENT_AGE,     // freshest input event when GetKeys returns
+    STAT_POLL_EVENT,    // event pump and dispatch per input read
+    STAT_LOCK_WAIT,     // critical_section waits on the input path
+    STAT_GETKEYS,       // whole GetKeys call
+    STAT_COUNT
+} StatId;
+
+typedef struct StatSummary
+{
+    uint32_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t max;
+} StatSummary;
+
+void stats_init(void);
+void stats_reset(void);
+void stats_record(StatId id, uint64_t ns);
+void stats_summary(StatId id, StatSummary *s);
+const char *stats_name(StatId id);
+void stats_format(StatId id, char *buf, size_t size);
+void stats_dump(void);
+
+/* how often a port's BUTTONS were reused instead of mapped again */
+void stats_cache(int hit);
+void stats_cache_format(char *buf, size_t size);
+
+static inline int64_t stats_now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+uint64_t stats_since_ns(int64_t start);
+
+static inline void stats_record_since(StatId id, int64_t start)
+{
+    stats_record(id, stats_since_ns(start));
+}
+
+/* EnterCriticalSection, recording how long it had to wait */
+static inline void stats_enter(CRITICAL_SECTION *cs)
+{
+    if (TryEnterCriticalSection(cs)) {
+        stats_record(STAT_LOCK_WAIT, 0);
+        return;
+    }
+    int64_t start = stats_now();
+    EnterCriticalSection(cs);
+    stats_record_since(STAT_LOCK_WAIT, start);
+}
+
+#endif